@@ -0,0 +1,154 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+
+#include "defines.h"
+#include "log.h"
+
+/*
+ * Shapes the requested pwm before it is written to the fan
+ */
+typedef struct {
+  // settings
+  unsigned hysteresis = 0;  // millidegrees the temperature must fall before slowing down
+  unsigned min_delta = 0;   // smallest pwm change worth a write
+  unsigned slew_up = 0;     // pwm per second, 0 is unlimited
+  unsigned slew_down = 0;
+  unsigned kick = 0;  // ms at full duty when the fan starts from 0
+
+  // hysteresis
+  unsigned hold_speed = 0;
+  unsigned hold_temp = 0;
+
+  bool has_written = false;
+  unsigned written = 0;  // assumed stopped before the first write
+  unsigned target = 0;   // last shaped value asked for, written when the kick ends
+  int64_t last_time = 0;
+  int64_t kick_until = 0;
+
+  unsigned long writes = 0;
+  unsigned long writes_avoided = 0;
+} actuator_t;
+
+/*
+ * Keep the speed until the temperature fell `hysteresis' below the one it was raised at
+ */
+unsigned actuator_hysteresis(actuator_t* act, unsigned speed, unsigned temp) {
+  if (speed > act->hold_speed || temp + act->hysteresis <= act->hold_temp) {
+    act->hold_speed = speed;
+    act->hold_temp = temp;
+  }
+
+  return act->hold_speed;
+}
+
+/*
+ * Force the next value to be written, e.g. after a reload
+ * the last written value is kept, a fan still stopped gets its kick
+ */
+void actuator_force(actuator_t* act) {
+  act->has_written = false;
+  act->hold_speed = 0;
+  act->hold_temp = 0;
+}
+
+/*
+ * The kick is over, drop from full duty to the last target
+ * returns true and sets `pwm' when the fan must be written
+ */
+bool actuator_kick_end(actuator_t* act, int64_t time_ms, unsigned* pwm) {
+  if (act->kick_until == 0) return false;
+
+  act->kick_until = 0;
+  act->last_time = time_ms;
+
+  if (act->written == act->target) return false;
+
+  act->written = act->target;
+  act->writes++;
+  *pwm = act->target;
+
+  return true;
+}
+
+/*
+ * Shape `target' and decide if it needs a write
+ * returns true and sets `pwm' when the fan must be written
+ */
+bool actuator_shape(actuator_t* act, unsigned target, unsigned pwm_cap, int64_t time_ms,
+                    unsigned* pwm) {
+  if (!act->has_written) {
+    act->last_time = time_ms;
+    act->kick_until = 0;
+  }
+
+  target = std::min(target, pwm_cap);
+  act->target = target;
+
+  // the kick timer did not fire before this tick, or the fan must stop
+  if (act->kick_until > 0 && (time_ms >= act->kick_until || target == 0)) {
+    return actuator_kick_end(act, time_ms, pwm);
+  }
+
+  // spin up at full duty, a stopped fan may not start at a low duty cycle
+  if (act->kick > 0 && act->written == 0 && target > 0) {
+    act->kick_until = time_ms + act->kick;
+    act->last_time = time_ms;
+    act->has_written = true;
+    act->written = pwm_cap;
+    act->writes++;
+    *pwm = pwm_cap;
+
+    return true;
+  }
+
+  if (act->kick_until > 0) {
+    // still kicking, actuator_kick_end() writes the target
+    return false;
+  }
+
+  if (act->has_written) {
+    unsigned delta = target > act->written ? target - act->written : act->written - target;
+
+    // small changes are skipped, but stopping and full speed are always reached
+    if (delta == 0 || (delta < act->min_delta && target != 0 && target != pwm_cap)) {
+      act->last_time = time_ms;
+      act->writes_avoided++;
+      return false;
+    }
+  }
+
+  unsigned value = target;
+
+  if (act->has_written && time_ms > act->last_time) {
+    // slew limits, the first step is always at least 1
+    double dt = (time_ms - act->last_time) / 1000.0;
+
+    if (act->slew_up > 0 && value > act->written) {
+      value = std::min(value, act->written + std::max(unsigned(act->slew_up * dt), 1u));
+    } else if (act->slew_down > 0 && value < act->written) {
+      unsigned step = std::max(unsigned(act->slew_down * dt), 1u);
+      value = std::max(value, act->written > step ? act->written - step : 0);
+    }
+  }
+
+  if (act->has_written && value != target) {
+    unsigned delta = value > act->written ? value - act->written : act->written - value;
+
+    // the slewed step is too small to write, the budget adds up until it is not
+    if (delta == 0 || delta < act->min_delta) {
+      act->writes_avoided++;
+      return false;
+    }
+  }
+
+  act->last_time = time_ms;
+  act->has_written = true;
+  act->written = value;
+  act->writes++;
+  *pwm = value;
+
+  return true;
+}
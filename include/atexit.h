@@ -1,15 +1,27 @@
 #pragma once
 
 #include <signal.h>
+#include <sys/signalfd.h>
 
 #include "defines.h"
+#include "governor.h"
 #include "jetson_clocks.h"
 #include "log.h"
 #include "pid.h"
+#include "recorder.h"
+#include "sensor_io.h"
+#include "telemetry.h"
+#include "trace.h"
+#include "uevent.h"
 #include "utils.h"
 
+// what the exit handler has to undo, set by the daemon as it goes
+static bool clocks_did_set = false;
+static bool is_first_run = false;
+static int tach_state = 0;
+
 /**
- * Exit handler. turn off the fan before leaving
+ * Exit handler. turn off the fan before leaving, the trace ends with the shutdown
  */
 void exit_handler(int status = EXIT_SUCCESS) {
   if (enable_tach) {
@@ -18,18 +30,46 @@ void exit_handler(int status = EXIT_SUCCESS) {
     write_file_int(TACH_ENABLE_PATH, tach_state);
   }
 
+  // clocks capped while the fan was stalled or too hot
+  clocks_uncap_freq();
+  governor_restore();
+
   if (enable_max_freq) {
     if (clocks_did_set) {
       const char* restore_from_path = is_first_run ? INITIAL_STORE_FILE : STORE_FILE;
 
       debug_log("restoring config %s", restore_from_path);
+      int64_t restore_start = now_real_us();
       restore_config(restore_from_path);
+      trace_span("restore_config", "clocks", restore_start, now_real_us(), "\"path\":\"%s\"",
+                 trace_arg(restore_from_path));
     }
   }
 
+  if (trips_did_set) {
+    debug_log("restoring trip points");
+    restore_trip_points();
+  }
+
   // set target pwm to 0
   debug_log("resetting target_pwm to 0");
+  int64_t write_start = now_real_us();
   write_file_int(TARGET_PWM_PATH, 0);
+  trace_span("pwm_write", "fan", write_start, now_real_us(), "\"pwm\":0");
+
+  log_sensor_stats();
+
+  // the last ticks are still in memory, errno is the exit status
+  int saved_errno = errno;
+  recorder_close(&recorder);
+  if (tracer.enabled) {
+    mkdir(STATE_DIR, 0755);
+    trace_write(TRACE_PATH);
+  }
+  errno = saved_errno;
+
+  unlink(CONTROL_SOCKET_PATH);
+  unlink(TELEMETRY_PATH);
 
   daemon_log(LOG_INFO, "removing pid file");
   if (pid_file_remove() < 0) {
@@ -43,17 +83,46 @@ void exit_handler(int status = EXIT_SUCCESS) {
 }
 
 /**
- * Initialize the exit handler
+ * Block SIGINT, SIGTERM, SIGHUP and SIGUSR1 and return a signalfd to read them from.
+ * The signals are handled in the event loop, so the exit handler never runs
+ * in signal context
  */
-void register_exit_handler() {
-  debug_log("registering exit handler for SIGINT, SIGTERM");
+int register_exit_handler() {
+  debug_log("registering exit handler for SIGINT, SIGTERM, SIGHUP and SIGUSR1");
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGHUP);
+  sigaddset(&mask, SIGUSR1);
 
-  struct sigaction sigint_handler;
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+    daemon_log(LOG_ERR, "cannot block signals: %s", strerror(errno));
+    sprintf_stderr("%s: cannot block signals: %s", argv0, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  int fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+  if (fd < 0) {
+    daemon_log(LOG_ERR, "cannot create signalfd: %s", strerror(errno));
+    sprintf_stderr("%s: cannot create signalfd: %s", argv0, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  return fd;
+}
 
-  sigint_handler.sa_handler = exit_handler;
-  sigemptyset(&sigint_handler.sa_mask);
-  sigint_handler.sa_flags = 0;
+/**
+ * Read a pending signal from the signalfd
+ * returns 0 if there is none
+ */
+int read_signal(int fd) {
+  struct signalfd_siginfo info;
+
+  if (read(fd, &info, sizeof(info)) != sizeof(info)) {
+    return 0;
+  }
 
-  sigaction(SIGINT, &sigint_handler, NULL);
-  sigaction(SIGTERM, &sigint_handler, NULL);
+  return info.ssi_signo;
 }
@@ -0,0 +1,276 @@
+#pragma once
+
+#include <math.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "defines.h"
+#include "interpolate.h"
+#include "log.h"
+#include "utils.h"
+
+using std::string;
+using std::vector;
+
+// one temperature sample per second while a step settles
+#define SWEEP_SAMPLE_MS 1000
+// the temperature must move less than SWEEP_STEADY_DELTA over SWEEP_STEADY_WINDOW samples
+#define SWEEP_STEADY_WINDOW 60
+#define SWEEP_STEADY_DELTA 250
+// samples averaged into the recorded temperature
+#define SWEEP_AVERAGE 10
+
+/*
+ * What the sweep drives, real hardware or a simulated plant
+ */
+typedef struct {
+  std::function<void(unsigned pwm)> set_pwm;
+  std::function<unsigned()> read_temp;  // millidegrees
+  std::function<int()> read_rpm;        // -1 without tachometer
+  std::function<bool(unsigned ms)> wait;  // false to abort
+} plant_io_t;
+
+typedef struct {
+  unsigned target = 65000;  // millidegrees
+  unsigned band = 10000;    // millidegrees
+  unsigned ambient = 25000;
+  unsigned limit = 85000;  // the sweep stops above this temperature
+  unsigned steps = 10;
+  unsigned settle = 600;  // seconds, longest wait per step
+} sweep_config_t;
+
+typedef struct {
+  unsigned pwm;
+  int rpm;
+  unsigned temp;     // millidegrees, steady state
+  unsigned seconds;  // time to settle
+  bool settled;
+  bool over_limit;  // a sample went above the limit
+} sweep_point_t;
+
+/*
+ * Drive `pwm' until the temperature is steady, false if aborted
+ */
+static bool sweep_step(const plant_io_t& io, const sweep_config_t& config, unsigned pwm,
+                       sweep_point_t* point) {
+  vector<unsigned> samples;
+
+  io.set_pwm(pwm);
+  point->pwm = pwm;
+  point->settled = false;
+  point->over_limit = false;
+
+  for (unsigned elapsed = 0; elapsed < config.settle; elapsed++) {
+    if (!io.wait(SWEEP_SAMPLE_MS)) return false;
+    samples.push_back(io.read_temp());
+
+    size_t n = samples.size();
+    if (samples.back() > config.limit) {
+      point->over_limit = true;
+      break;
+    }
+
+    if (n > SWEEP_STEADY_WINDOW) {
+      unsigned then = samples[n - 1 - SWEEP_STEADY_WINDOW];
+      unsigned delta = samples.back() > then ? samples.back() - then : then - samples.back();
+
+      if (delta <= SWEEP_STEADY_DELTA) {
+        point->settled = true;
+        break;
+      }
+    }
+  }
+
+  size_t count = std::min(samples.size(), size_t(SWEEP_AVERAGE));
+  unsigned long sum = 0;
+  for (size_t i = samples.size() - count; i < samples.size(); i++) sum += samples[i];
+
+  point->temp = count > 0 ? sum / count : io.read_temp();
+  point->rpm = io.read_rpm();
+  point->seconds = samples.size() * SWEEP_SAMPLE_MS / 1000;
+
+  return true;
+}
+
+/*
+ * Sweep from pwm_cap down in `steps' steps, stops once the board gets hotter than
+ * the limit and leaves the fan at pwm_cap then
+ */
+vector<sweep_point_t> characterize_sweep(const plant_io_t& io, const sweep_config_t& config,
+                                         unsigned pwm_cap) {
+  vector<sweep_point_t> points;
+  unsigned steps = std::max(config.steps, 1u);
+
+  for (unsigned i = steps + 1; i-- > 0;) {
+    sweep_point_t point;
+    unsigned pwm = pwm_cap * i / steps;
+
+    if (!sweep_step(io, config, pwm, &point)) break;
+
+    sprintf_stderr("%s: pwm %3u: %6.3f C, %d rpm, %u s%s", argv0, point.pwm, point.temp / 1000.0,
+                   point.rpm, point.seconds, point.settled ? "" : " (not settled)");
+    points.push_back(point);
+
+    if (point.over_limit) {
+      sprintf_stderr("%s: above %.3f C, stopping the sweep", argv0, config.limit / 1000.0);
+      io.set_pwm(pwm_cap);
+      break;
+    }
+  }
+
+  return points;
+}
+
+bool write_sweep_csv(const vector<sweep_point_t>& points, unsigned pwm_cap, const char* path) {
+  std::ofstream out_stream(path, std::ios::out);
+
+  if (!out_stream) {
+    daemon_log(LOG_ERR, "cannot write `%s'", path);
+    return false;
+  }
+
+  out_stream << "pwm,speed_percent,rpm,temperature_mc,seconds,settled\n";
+  for (const auto& point : points) {
+    out_stream << point.pwm << "," << point.pwm * 100.0 / pwm_cap << "," << point.rpm << ","
+               << point.temp << "," << point.seconds << "," << point.settled << "\n";
+  }
+
+  return out_stream.good();
+}
+
+/*
+ * Fit the cooling response, the conductance grows linearly with the fan speed:
+ *
+ *   1 / (T - ambient) = a + b * speed
+ *
+ * with speed between 0 and 1. Steps that did not settle are left out.
+ * Returns false with less than two usable points.
+ */
+bool fit_cooling(const vector<sweep_point_t>& points, const sweep_config_t& config,
+                 unsigned pwm_cap, double* a, double* b) {
+  double sx = 0, sy = 0, sxx = 0, sxy = 0;
+  unsigned n = 0;
+
+  for (const auto& point : points) {
+    if (!point.settled || point.temp <= config.ambient + 1000) continue;
+
+    double x = double(point.pwm) / pwm_cap;
+    double y = 1000.0 / (point.temp - config.ambient);
+
+    sx += x;
+    sy += y;
+    sxx += x * x;
+    sxy += x * y;
+    n++;
+  }
+
+  double det = n * sxx - sx * sx;
+  if (n < 2 || fabs(det) < 1e-12) return false;
+
+  *b = (n * sxy - sx * sy) / det;
+  *a = (sy - *b * sx) / n;
+
+  return true;
+}
+
+/*
+ * Lowest fan speed (percent) keeping the fitted steady state at the target
+ */
+unsigned characterize_speed(const sweep_config_t& config, double a, double b) {
+  if (config.target <= config.ambient || b <= 0) return 100;
+
+  double needed = (1000.0 / (config.target - config.ambient) - a) / b;
+  return unsigned(std::clamp(ceil(needed * 100), 0.0, 100.0));
+}
+
+/*
+ * Table in the parse_table format: silent below target - band, the fitted
+ * speed at the target, full speed half a band above it
+ */
+vector<coord_t> characterize_table(const sweep_config_t& config, unsigned speed) {
+  vector<coord_t> table;
+  unsigned target = std::max(config.target / 1000, 2u);
+  unsigned band = std::clamp(config.band / 1000, 2u, target);
+
+  table.push_back({target - band, 0});
+  table.push_back({target, speed});
+
+  if (speed < 100) {
+    table.push_back({target + band / 2, 100});
+  }
+
+  return table;
+}
+
+/*
+ * Run the sweep, write the raw data to `csv_path' and print the table
+ */
+bool characterize(const plant_io_t& io, const sweep_config_t& config, unsigned pwm_cap,
+                  const char* csv_path) {
+  double a, b;
+
+  sprintf_stderr("%s: sweeping %u steps up to pwm %u, target %.3f C", argv0, config.steps,
+                 pwm_cap, config.target / 1000.0);
+
+  vector<sweep_point_t> points = characterize_sweep(io, config, pwm_cap);
+
+  if (write_sweep_csv(points, pwm_cap, csv_path)) {
+    sprintf_stderr("%s: sweep data written to `%s'", argv0, csv_path);
+  }
+
+  if (!fit_cooling(points, config, pwm_cap, &a, &b)) {
+    sprintf_stderr("%s: not enough data to fit the cooling response", argv0);
+    return false;
+  }
+
+  unsigned speed = characterize_speed(config, a, b);
+  sprintf_stderr("%s: fitted 1/(T - ambient) = %.5f + %.5f * speed, %u%% holds %.3f C", argv0, a,
+                 b, speed, config.target / 1000.0);
+
+  if (speed >= 100) {
+    sprintf_stderr("%s: the target cannot be held at full speed", argv0);
+  }
+
+  for (const auto& row : characterize_table(config, speed)) {
+    printf("%u %u\n", row.x, row.y);
+  }
+
+  return true;
+}
+
+/*
+ * Keep every cpu busy, returns the pids to pass to stop_load
+ */
+vector<pid_t> start_load() {
+  vector<pid_t> children;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  for (long i = 0; i < cpus; i++) {
+    pid_t child = fork();
+
+    if (child == 0) {
+      // spin until killed, or until the parent dies
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+      volatile unsigned long spin = 0;
+      for (;;) spin++;
+    }
+
+    if (child > 0) children.push_back(child);
+  }
+
+  debug_log("started %zu load processes", children.size());
+  return children;
+}
+
+void stop_load(const vector<pid_t>& children) {
+  for (pid_t child : children) kill(child, SIGKILL);
+  for (pid_t child : children) waitpid(child, NULL, 0);
+}
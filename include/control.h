@@ -0,0 +1,411 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <string>
+
+#include "defines.h"
+#include "json.h"
+#include "log.h"
+#include "reactor.h"
+#include "state.h"
+#include "trace.h"
+#include "utils.h"
+
+using std::string;
+
+#define CONTROL_REQUEST_SIZE 64
+// clients served at the same time
+#define CONTROL_MAX_CLIENTS 8
+#define CONTROL_CLIENT_TIMEOUT_MS 1000
+
+/*
+ * Format the snapshot as human readable text
+ */
+string format_status_text(const daemon_state_t& state) {
+  string out;
+  int64_t now = now_ms();
+
+  out += string_format("process pid: %d\n", getpid());
+  out += string_format("uptime: %lld s\n", (long long)(now - state.start_time) / 1000);
+  out += string_format("temperature: %u.%03u C\n", state.temperature / 1000,
+                       state.temperature % 1000);
+
+  if (state.sensors && state.zones) {
+    for (size_t i = 0; i < state.sensors->size(); i++) {
+      const auto& sensor = (*state.sensors)[i];
+      const auto& filter = state.zones->filters[i];
+      out += string_format("  %s (%s): %.3f C, filtered %.3f C, weight %u%s",
+                           state.zones->names[i].c_str(), sensor.path.c_str(),
+                           sensor.value / 1000.0, filter.output / 1000.0, state.zones->weights[i],
+                           state.zones->curves[i] != ZONE_NO_CURVE ? ", own curve" : "");
+
+      if (filter.quarantined) {
+        out += string_format(", quarantined (%s)", filter.reason);
+      }
+
+      out += "\n";
+    }
+  }
+
+  out += string_format("mode: %s\n", state.mode);
+
+  if (strcmp(state.mode, "mpc") == 0) {
+    out += string_format("model: tau %.1f s, gain %.3f C/%%, %lu samples (%s)\n",
+                         state.mpc_time_constant, state.mpc_gain, state.mpc_samples,
+                         state.mpc_active ? "active" : "learning, using the table");
+  } else if (strcmp(state.mode, "pid") == 0) {
+    out += string_format("setpoint: %u.%03uC, integral %.2f%%\n", state.pid_setpoint / 1000,
+                         state.pid_setpoint % 1000, state.pid_integral);
+  }
+
+  out += string_format("control speed: %u.%02u%%\n", state.speed / 100, state.speed % 100);
+  out += string_format("load boost: %u.%02u%%\n", state.boost / 100, state.boost % 100);
+  out += string_format("throttle events: %lu (%lu ticks), curve offset: %u.%03u C\n",
+                       state.throttle_events, state.throttled_ticks, state.throttle_offset / 1000,
+                       state.throttle_offset % 1000);
+  out += string_format("target pwm: %u (requested %u)\n", state.target_pwm, state.requested_pwm);
+  out += string_format("pwm writes: %lu, avoided: %lu\n", state.pwm_writes,
+                       state.pwm_writes_avoided);
+  out += string_format("current pwm: %d\n", state.cur_pwm);
+
+  if (state.rpm >= 0) {
+    out += string_format("current rpm: %d\n", state.rpm);
+
+    if (state.rpm_target >= 0) {
+      out += string_format("target rpm: %d\n", state.rpm_target);
+    }
+
+    out += string_format("fan: %s, %lu stalls\n", state.fan_stalled ? "STALLED" : "ok",
+                         state.fan_stalls);
+  } else {
+    out += "tachometer is disabled\n";
+  }
+
+  if (state.dvfs_level > 0 || state.dvfs_steps > 0) {
+    out += string_format("clock limit: step %u/%u, %lu steps down so far\n", state.dvfs_level,
+                         state.dvfs_max_level, state.dvfs_steps);
+  }
+
+  out += string_format("interval: %u ms\n", state.interval);
+  out += string_format("ticks: %lu\n", state.ticks);
+  out += string_format("last tick: %lld ms ago, took %u us\n",
+                       (long long)(now - state.last_tick), state.tick_duration);
+
+  if (state.latency) {
+    const latency_t* latency = state.latency;
+
+    out += string_format("latency over the last %lld s (us):\n",
+                         (long long)(now - latency->since) / 1000);
+    out += string_format("  %-18s %8s  %7s %7s %7s %7s %8s\n", "", "count", "mean", "p50", "p90",
+                         "p99", "max");
+    out += format_histogram_text("wakeup", &latency->wakeup);
+    for (size_t i = 0; state.zones && i < latency->sensor_read.size(); i++) {
+      out += format_histogram_text(("read " + state.zones->names[i]).c_str(),
+                                   &latency->sensor_read[i]);
+    }
+    out += format_histogram_text("aggregate", &latency->aggregate);
+    out += format_histogram_text("pwm write", &latency->pwm_write);
+    out += format_histogram_text("tick", &latency->tick);
+  }
+
+  return out;
+}
+
+/*
+ * Format the snapshot as a single JSON object
+ */
+string format_status_json(const daemon_state_t& state) {
+  string out;
+  int64_t now = now_ms();
+
+  out += "{";
+  out += string_format("\"pid\":%d,", getpid());
+  out += string_format("\"uptime_ms\":%lld,", (long long)(now - state.start_time));
+  out += string_format("\"temperature\":%u,", state.temperature);
+  out += "\"sensors\":[";
+
+  if (state.sensors && state.zones) {
+    for (size_t i = 0; i < state.sensors->size(); i++) {
+      const auto& sensor = (*state.sensors)[i];
+      out += string_format(
+          "%s{\"name\":\"%s\",\"path\":\"%s\",\"temperature\":%d,\"filtered\":%d,"
+          "\"weight\":%u,\"own_curve\":%s,\"quarantined\":%s,\"reason\":\"%s\","
+          "\"quarantines\":%lu}",
+          i > 0 ? "," : "", json_string(state.zones->names[i]).c_str(),
+          json_string(sensor.path).c_str(), sensor.value,
+          state.zones->filters[i].output, state.zones->weights[i],
+          state.zones->curves[i] != ZONE_NO_CURVE ? "true" : "false",
+          state.zones->filters[i].quarantined ? "true" : "false",
+          state.zones->filters[i].reason, state.zones->filters[i].quarantines);
+    }
+  }
+
+  out += "],";
+  out += string_format("\"mode\":\"%s\",", state.mode);
+  out += string_format("\"mpc_active\":%s,", state.mpc_active ? "true" : "false");
+  out += string_format("\"mpc_samples\":%lu,", state.mpc_samples);
+  out += string_format("\"mpc_time_constant\":%.3f,", state.mpc_time_constant);
+  out += string_format("\"mpc_gain\":%.5f,", state.mpc_gain);
+  out += string_format("\"pid_setpoint\":%u,", state.pid_setpoint);
+  out += string_format("\"pid_integral\":%.3f,", state.pid_integral);
+  out += string_format("\"speed\":%u,", state.speed);
+  out += string_format("\"boost\":%u,", state.boost);
+  out += string_format("\"throttle_events\":%lu,", state.throttle_events);
+  out += string_format("\"throttled_ticks\":%lu,", state.throttled_ticks);
+  out += string_format("\"throttle_offset\":%u,", state.throttle_offset);
+  out += string_format("\"target_pwm\":%u,", state.target_pwm);
+  out += string_format("\"requested_pwm\":%u,", state.requested_pwm);
+  out += string_format("\"pwm_writes\":%lu,", state.pwm_writes);
+  out += string_format("\"pwm_writes_avoided\":%lu,", state.pwm_writes_avoided);
+  out += string_format("\"cur_pwm\":%d,", state.cur_pwm);
+  out += string_format("\"rpm\":%d,", state.rpm);
+  out += string_format("\"rpm_target\":%d,", state.rpm_target);
+  out += string_format("\"fan_stalled\":%s,", state.fan_stalled ? "true" : "false");
+  out += string_format("\"fan_stalls\":%lu,", state.fan_stalls);
+  out += string_format("\"dvfs_level\":%u,", state.dvfs_level);
+  out += string_format("\"dvfs_max_level\":%u,", state.dvfs_max_level);
+  out += string_format("\"dvfs_steps\":%lu,", state.dvfs_steps);
+  out += string_format("\"interval_ms\":%u,", state.interval);
+  out += string_format("\"ticks\":%lu,", state.ticks);
+  out += string_format("\"last_tick_ms\":%lld,", (long long)(now - state.last_tick));
+  out += string_format("\"tick_duration_us\":%u", state.tick_duration);
+
+  if (state.latency) {
+    const latency_t* latency = state.latency;
+
+    out += string_format(",\"latency\":{\"since_ms\":%lld,", (long long)(now - latency->since));
+    out += "\"wakeup\":" + format_histogram_json(&latency->wakeup) + ",\"sensor_read\":[";
+    for (size_t i = 0; state.zones && i < latency->sensor_read.size(); i++) {
+      out += string_format("%s{\"name\":\"%s\",\"latency\":", i > 0 ? "," : "",
+                           json_string(state.zones->names[i]).c_str());
+      out += format_histogram_json(&latency->sensor_read[i]) + "}";
+    }
+    out += "],\"aggregate\":" + format_histogram_json(&latency->aggregate);
+    out += ",\"pwm_write\":" + format_histogram_json(&latency->pwm_write);
+    out += ",\"tick\":" + format_histogram_json(&latency->tick) + "}";
+  }
+
+  out += "}\n";
+
+  return out;
+}
+
+static void fill_sockaddr(struct sockaddr_un* addr, const char* path) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+}
+
+/*
+ * Listen on the control socket
+ * returns -1 on failure
+ */
+int control_open(const char* path) {
+  struct sockaddr_un addr;
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+
+  if (fd < 0) {
+    daemon_log(LOG_WARNING, "cannot create control socket: %s", strerror(errno));
+    return -1;
+  }
+
+  // a stale socket from a previous run
+  unlink(path);
+  fill_sockaddr(&addr, path);
+
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+    daemon_log(LOG_WARNING, "cannot listen on `%s': %s", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  // status is readable by everyone, like the sysfs files it used to read
+  chmod(path, 0666);
+
+  return fd;
+}
+
+/*
+ * A client of the control socket, served by the reactor without ever blocking
+ */
+typedef struct {
+  int fd;
+  bool privileged;   // may send requests changing the daemon
+  int64_t accepted;  // milliseconds
+  string request;
+  string response;
+  size_t sent = 0;
+} control_client_t;
+
+typedef struct {
+  int fd = -1;
+  std::map<int, control_client_t> clients;
+} control_t;
+
+static void control_drop(reactor_t* reactor, control_t* control, int fd) {
+  reactor_remove(reactor, fd);
+  close(fd);
+  control->clients.erase(fd);
+}
+
+/*
+ * Root, or whoever runs the daemon under a fake root
+ */
+static bool control_peer_privileged(int fd) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) return false;
+
+  return cred.uid == 0 || cred.uid == geteuid();
+}
+
+/*
+ * Answer a complete request
+ * a request is a single line, `json', `reset-latency', `trace' or anything else for text.
+ * `trace' is answered with the path the trace was written to.
+ */
+static string control_respond(const control_client_t& client, const daemon_state_t& state) {
+  const char* request = client.request.c_str();
+
+  if (strcmp(request, "reset-latency") == 0 && state.latency) {
+    if (!client.privileged) return "permission denied\n";
+
+    latency_reset(state.latency);
+    return "latency histograms reset\n";
+  } else if (strcmp(request, "trace") == 0) {
+    if (!tracer.enabled) return "tracing is disabled, set trace = yes\n";
+    if (!client.privileged) return "permission denied\n";
+
+    // megabytes are better read from a file than sent while the fan waits
+    mkdir(STATE_DIR, 0755);
+    if (!trace_write(TRACE_PATH)) return string_format("cannot write `%s'\n", TRACE_PATH);
+
+    return string(TRACE_PATH) + "\n";
+  }
+
+  return strcmp(request, "json") == 0 ? format_status_json(state) : format_status_text(state);
+}
+
+/*
+ * Read the request, then write the response as the socket drains
+ */
+static void control_serve(reactor_t* reactor, control_t* control, int fd, uint32_t events,
+                          const daemon_state_t& state) {
+  auto it = control->clients.find(fd);
+  if (it == control->clients.end()) return;
+
+  control_client_t& client = it->second;
+  ssize_t n;
+
+  if (client.response.empty()) {
+    char buf[CONTROL_REQUEST_SIZE];
+
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+      client.request.append(buf, n);
+    }
+
+    size_t end = client.request.find_first_of("\r\n");
+    bool complete = end != string::npos || n == 0 || client.request.size() >= CONTROL_REQUEST_SIZE;
+
+    if (!complete) {
+      if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) control_drop(reactor, control, fd);
+      return;
+    }
+
+    if (end != string::npos) client.request.resize(end);
+    client.response = control_respond(client, state);
+    reactor_modify(reactor, fd, EPOLLOUT);
+  } else if (!(events & EPOLLOUT)) {
+    return;
+  }
+
+  while (client.sent < client.response.size()) {
+    n = send(fd, client.response.c_str() + client.sent, client.response.size() - client.sent,
+             MSG_NOSIGNAL);
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (n <= 0) break;
+
+    client.sent += n;
+  }
+
+  control_drop(reactor, control, fd);
+}
+
+/*
+ * Accept the pending clients, at most CONTROL_MAX_CLIENTS per wakeup and at once.
+ * A client that did not get its answer within CONTROL_CLIENT_TIMEOUT_MS is dropped.
+ */
+void control_handle(reactor_t* reactor, control_t* control, const daemon_state_t& state) {
+  int64_t now = now_real_us() / 1000;
+
+  for (auto it = control->clients.begin(); it != control->clients.end();) {
+    auto next = std::next(it);
+    if (now - it->second.accepted >= CONTROL_CLIENT_TIMEOUT_MS) {
+      control_drop(reactor, control, it->first);
+    }
+    it = next;
+  }
+
+  for (unsigned accepted = 0; accepted < CONTROL_MAX_CLIENTS; accepted++) {
+    int fd = accept4(control->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0) return;
+
+    // make room by dropping the oldest, idle connections cannot lock the others out
+    if (control->clients.size() >= CONTROL_MAX_CLIENTS) {
+      auto oldest = std::min_element(
+          control->clients.begin(), control->clients.end(),
+          [](const auto& a, const auto& b) { return a.second.accepted < b.second.accepted; });
+      control_drop(reactor, control, oldest->first);
+    }
+
+    control_client_t& client = control->clients[fd];
+    client.fd = fd;
+    client.privileged = control_peer_privileged(fd);
+    client.accepted = now;
+
+    reactor_add(reactor, fd, [reactor, control, fd, &state](uint32_t events) {
+      control_serve(reactor, control, fd, events, state);
+    });
+  }
+}
+
+/*
+ * Send a request to the daemon and return the response
+ * returns false if the daemon cannot be reached
+ */
+bool control_request(const char* path, const char* request, string* response) {
+  struct sockaddr_un addr;
+  char buf[1024];
+  ssize_t len;
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if (fd < 0) return false;
+
+  fill_sockaddr(&addr, path);
+
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return false;
+  }
+
+  string line = string(request) + "\n";
+  send(fd, line.c_str(), line.size(), MSG_NOSIGNAL);
+
+  response->clear();
+  while ((len = recv(fd, buf, sizeof(buf), 0)) > 0) {
+    response->append(buf, len);
+  }
+
+  close(fd);
+  return true;
+}
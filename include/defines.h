@@ -3,50 +3,71 @@
 #include <string>
 
 #include "config.h"
+#include "root.h"
 
 #define TEGRA_186 "tegra186"
 #define TEGRA_210 "tegra210"
 #define TEGRA_194 "tegra194"
 
-#define JETSON_CLOCKS_PATH "/usr/bin/jetson_clocks"
+// every path is resolved under the root set with --root, see root.h
 // general
-#define SOC_FAMILY_PATH "/proc/device-tree/compatible"
-#define MACHINE_NAME_PATH "/proc/device-tree/model"
+#define SOC_FAMILY_PATH root_path("/proc/device-tree/compatible")
+#define MACHINE_NAME_PATH root_path("/proc/device-tree/model")
 // thermal
-#define THERMAL_ZONE_GLOB "/sys/devices/virtual/thermal/thermal_zone*"
+#define THERMAL_ZONE_GLOB root_path("/sys/devices/virtual/thermal/thermal_zone*")
 // fan
-#define PWM_CAP_PATH "/sys/devices/pwm-fan/pwm_cap"
-#define TARGET_PWM_PATH "/sys/devices/pwm-fan/target_pwm"
-#define CUR_PWM_PATH "/sys/devices/pwm-fan/cur_pwm"
-#define TEMP_CONTROL_PATH "/sys/devices/pwm-fan/temp_control"
-#define TACH_ENABLE_PATH "/sys/devices/pwm-fan/tach_enable"
-#define MEASURED_RPM_PATH "/sys/devices/pwm-fan/rpm_measured"
+#define PWM_CAP_PATH root_path("/sys/devices/pwm-fan/pwm_cap")
+#define TARGET_PWM_PATH root_path("/sys/devices/pwm-fan/target_pwm")
+#define CUR_PWM_PATH root_path("/sys/devices/pwm-fan/cur_pwm")
+#define TEMP_CONTROL_PATH root_path("/sys/devices/pwm-fan/temp_control")
+#define TACH_ENABLE_PATH root_path("/sys/devices/pwm-fan/tach_enable")
+#define MEASURED_RPM_PATH root_path("/sys/devices/pwm-fan/rpm_measured")
 // cpu
-#define CPU_GLOB "/sys/devices/system/cpu/cpu[0-9]*"
-#define CPU_IDLE_STATE_GLOB "/sys/devices/system/cpu/cpu[0-9]/cpuidle/state[0-9]/disable"
+#define CPU_GLOB root_path("/sys/devices/system/cpu/cpu[0-9]*")
+#define CPU_IDLE_STATE_GLOB root_path("/sys/devices/system/cpu/cpu[0-9]/cpuidle/state[0-9]/disable")
+// load
+#define PROC_STAT_PATH root_path("/proc/stat")
+#define CPU_PRESSURE_PATH root_path("/proc/pressure/cpu")
 // gpu
-#define GPU_GLOB "/sys/class/devfreq/*"
+#define GPU_GLOB root_path("/sys/class/devfreq/*")
 // emc
-#define TEGRA_210_EMC_MIN_FREQ_PATH "/sys/kernel/debug/tegra_bwmgr/emc_min_rate"
-#define TEGRA_210_EMC_MAX_FREQ_PATH "/sys/kernel/debug/tegra_bwmgr/emc_max_rate"
-#define TEGRA_210_EMC_CUR_FREQ_PATH "/sys/kernel/debug/clk/override.emc/clk_rate"
-#define TEGRA_210_EMC_UPDATE_FREQ_PATH "/sys/kernel/debug/clk/override.emc/clk_update_rate"
-#define TEGRA_210_EMC_FREQ_OVERRIDE_PATH "/sys/kernel/debug/clk/override.emc/clk_state"
+#define TEGRA_210_EMC_MIN_FREQ_PATH root_path("/sys/kernel/debug/tegra_bwmgr/emc_min_rate")
+#define TEGRA_210_EMC_MAX_FREQ_PATH root_path("/sys/kernel/debug/tegra_bwmgr/emc_max_rate")
+#define TEGRA_210_EMC_CUR_FREQ_PATH root_path("/sys/kernel/debug/clk/override.emc/clk_rate")
+#define TEGRA_210_EMC_UPDATE_FREQ_PATH root_path("/sys/kernel/debug/clk/override.emc/clk_update_rate")
+#define TEGRA_210_EMC_FREQ_OVERRIDE_PATH root_path("/sys/kernel/debug/clk/override.emc/clk_state")
+// tegra186 and tegra194 go through the bpmp
+#define BPMP_EMC_ISO_CAP_PATH root_path("/sys/kernel/nvpmodel_emc_cap/emc_iso_cap")
+#define BPMP_EMC_MAX_FREQ_PATH root_path("/sys/kernel/debug/bpmp/debug/clk/emc/max_rate")
+#define BPMP_EMC_UPDATE_FREQ_PATH root_path("/sys/kernel/debug/bpmp/debug/clk/emc/rate")
+#define BPMP_EMC_FREQ_OVERRIDE_PATH root_path("/sys/kernel/debug/bpmp/debug/clk/emc/mrq_rate_locked")
 
 // configurations
-#define TABLE_PATH "/etc/fantable/table"
-#define STORE_FILE "/etc/fantable/state.conf"
-#define INITIAL_STORE_FILE "/etc/fantable/initial_state.conf"
-#define CONFIG_FILE_PATH "/etc/fantable/config"
+#define CONFIG_DIR root_path("/etc/fantable")
+#define TABLE_PATH root_path("/etc/fantable/table")
+#define STORE_FILE root_path("/etc/fantable/state.conf")
+#define INITIAL_STORE_FILE root_path("/etc/fantable/initial_state.conf")
+#define CONFIG_FILE_PATH root_path("/etc/fantable/config")
+// persistent state
+#define STATE_DIR root_path("/var/lib/" PACKAGE_NAME)
+#define MODEL_STATE_PATH root_path("/var/lib/" PACKAGE_NAME "/model")
+#define CHARACTERIZE_CSV_PATH root_path("/var/lib/" PACKAGE_NAME "/characterize.csv")
+// runtime
+#define VARRUN root_path("/var/run")
+#define CONTROL_SOCKET_PATH root_path("/var/run/" PACKAGE_NAME ".sock")
+// written on SIGUSR1 when tracing
+#define TRACE_PATH root_path("/var/lib/" PACKAGE_NAME "/trace.json")
+// parameters of the simulated board, only read under a fake root
+#define PLANT_PATH root_path("/plant")
 
+// upper bound to wait for nvpmodel, in seconds
 #define MAX_FREQ_WAIT 30
+// the power model is settled after this many identical reads, FREQ_SETTLE_INTERVAL ms apart
+#define FREQ_SETTLE_READS 4
+#define FREQ_SETTLE_INTERVAL 250
 
 static const char* argv0 = PACKAGE_NAME;
 
 static bool enable_debug = false;
 static bool enable_max_freq = true;
 static bool enable_tach = false;
-
-static bool clocks_did_set = false;
-static bool is_first_run = false;
-static int tach_state = 0;
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+
+#include "defines.h"
+#include "log.h"
+
+// largest median window, the ring buffer is sized for it
+#define FILTER_MAX_WINDOW 15
+
+/*
+ * Settings shared by every sensor, temperatures in millidegrees
+ */
+typedef struct {
+  unsigned median_window = 1;  // samples, 1 disables the median
+  double ema_alpha = 1.0;      // weight of the new sample, 1 disables the EMA
+  unsigned max_rate = 0;       // millidegrees per second, 0 disables the limit
+  int min_temp = -30000;       // readings outside the range are rejected
+  int max_temp = 99000;
+  unsigned stuck_ticks = 0;    // identical readings before quarantine, 0 disables
+  unsigned readmit_ticks = 5;  // good readings before a sensor is used again
+} filter_config_t;
+
+/*
+ * Per sensor state, no allocation after setup
+ */
+typedef struct {
+  int window[FILTER_MAX_WINDOW];
+  unsigned head = 0;
+  unsigned count = 0;
+
+  bool primed = false;
+  double ema = 0;
+  int output = 0;
+  int64_t last_time = 0;
+
+  int last_raw = 0;
+  unsigned same_count = 0;
+  unsigned good_count = 0;
+
+  bool quarantined = false;
+  const char* reason = "";
+  unsigned long quarantines = 0;
+} sensor_filter_t;
+
+static void filter_restart(sensor_filter_t* filter) {
+  filter->head = 0;
+  filter->count = 0;
+  filter->primed = false;
+}
+
+static int filter_median(const sensor_filter_t* filter) {
+  int sorted[FILTER_MAX_WINDOW];
+
+  std::copy(filter->window, filter->window + filter->count, sorted);
+  std::nth_element(sorted, sorted + filter->count / 2, sorted + filter->count);
+
+  return sorted[filter->count / 2];
+}
+
+/*
+ * Feed a raw reading, returns false while the sensor is quarantined.
+ * The filtered value is left in `output'.
+ */
+bool filter_update(const filter_config_t& config, sensor_filter_t* filter, const char* name,
+                   int raw, int64_t time_ms) {
+  const char* reason = nullptr;
+
+  filter->same_count = raw == filter->last_raw ? filter->same_count + 1 : 0;
+  filter->last_raw = raw;
+
+  if (raw < config.min_temp || raw > config.max_temp) {
+    reason = "out of range";
+  } else if (config.stuck_ticks > 0 && filter->same_count >= config.stuck_ticks) {
+    reason = "stuck";
+  }
+
+  if (reason) {
+    filter->good_count = 0;
+
+    if (!filter->quarantined) {
+      daemon_log(LOG_WARNING, "quarantining sensor %s: %s at %d", name, reason, raw);
+      filter->quarantined = true;
+      filter->reason = reason;
+      filter->quarantines++;
+    }
+
+    return false;
+  }
+
+  if (filter->quarantined) {
+    if (++filter->good_count < config.readmit_ticks) {
+      return false;
+    }
+
+    daemon_log(LOG_INFO, "sensor %s is back", name);
+    filter->quarantined = false;
+    filter->reason = "";
+    filter_restart(filter);
+  }
+
+  // windowed median
+  unsigned window = std::clamp(config.median_window, 1u, unsigned(FILTER_MAX_WINDOW));
+  filter->window[filter->head] = raw;
+  filter->head = (filter->head + 1) % window;
+  filter->count = std::min(filter->count + 1, window);
+
+  int value = filter_median(filter);
+
+  if (!filter->primed) {
+    filter->primed = true;
+    filter->ema = value;
+    filter->output = value;
+    filter->last_time = time_ms;
+    return true;
+  }
+
+  // rate of change limit
+  if (config.max_rate > 0 && time_ms > filter->last_time) {
+    double step = double(config.max_rate) * (time_ms - filter->last_time) / 1000;
+    value = std::clamp(double(value), filter->ema - step, filter->ema + step);
+  }
+
+  filter->ema += config.ema_alpha * (value - filter->ema);
+  filter->output = int(filter->ema + (filter->ema < 0 ? -0.5 : 0.5));
+  filter->last_time = time_ms;
+
+  return true;
+}
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "defines.h"
+#include "jetson_clocks.h"
+#include "log.h"
+
+using std::string;
+using std::vector;
+
+// steps between the minimum and the maximum when a clock has no frequency table
+#define DVFS_DEFAULT_STEPS 10
+
+/*
+ * A clock the governor can slow down
+ */
+typedef struct {
+  string min_path;
+  string max_path;
+  vector<long> frequencies;  // ascending, up to the saved maximum
+  size_t floor_index = 0;    // lowest frequency the governor may use
+  string saved_min;
+  string saved_max;
+} dvfs_domain_t;
+
+/*
+ * Last resort once the fan is at full speed: lower the clock limits one
+ * step at a time while the temperature is above `trigger', raise them
+ * again below `release'
+ */
+typedef struct {
+  // settings
+  unsigned trigger = 80000;  // millidegrees
+  unsigned release = 75000;
+  unsigned hold = 3;    // ticks between two steps
+  unsigned floor = 50;  // percent of the maximum frequency
+
+  unsigned level = 0;  // steps below the maximum
+  unsigned max_level = 0;
+  unsigned wait = 0;
+  unsigned long steps_down = 0;
+} governor_t;
+
+// limits changed by the governor, restored on exit
+static vector<dvfs_domain_t> dvfs_domains;
+
+static vector<long> parse_frequencies(const string& list) {
+  std::istringstream stream(list);
+  vector<long> frequencies;
+  long frequency;
+
+  while (stream >> frequency) frequencies.push_back(frequency);
+  std::sort(frequencies.begin(), frequencies.end());
+
+  return frequencies;
+}
+
+static void add_dvfs_domain(const governor_t* gov, const string& min_path, const string& max_path,
+                            const string& available_path, const string& lowest_path) {
+  dvfs_domain_t domain;
+  string value;
+
+  if (!read_value(min_path, &domain.saved_min) || !read_value(max_path, &domain.saved_max)) {
+    return;
+  }
+
+  long saved_max = atol(domain.saved_max.c_str());
+
+  if (read_value(available_path, &value)) {
+    domain.frequencies = parse_frequencies(value);
+  }
+
+  // no frequency table, interpolate between the lowest and the current maximum
+  if (domain.frequencies.empty() && !lowest_path.empty() && read_value(lowest_path, &value)) {
+    long lowest = atol(value.c_str());
+    for (int i = 0; i <= DVFS_DEFAULT_STEPS; i++) {
+      domain.frequencies.push_back(lowest + (saved_max - lowest) * i / DVFS_DEFAULT_STEPS);
+    }
+  }
+
+  // the power model may allow less than the hardware
+  while (!domain.frequencies.empty() && domain.frequencies.back() > saved_max) {
+    domain.frequencies.pop_back();
+  }
+
+  if (domain.frequencies.size() < 2) return;
+
+  long floor = saved_max * gov->floor / 100;
+  while (domain.floor_index + 1 < domain.frequencies.size() &&
+         domain.frequencies[domain.floor_index] < floor) {
+    domain.floor_index++;
+  }
+
+  domain.min_path = min_path;
+  domain.max_path = max_path;
+  dvfs_domains.push_back(domain);
+}
+
+/*
+ * Save the current limits, they are what the clocks go back to
+ */
+static void governor_setup(governor_t* gov) {
+  dvfs_domains.clear();
+  gov->max_level = 0;
+
+  for (const auto& cpu : glob_paths(CPU_GLOB)) {
+    string policy = cpu + "/cpufreq/";
+    add_dvfs_domain(gov, policy + "scaling_min_freq", policy + "scaling_max_freq",
+                    policy + "scaling_available_frequencies", policy + "cpuinfo_min_freq");
+  }
+
+  for (const auto& gpu : gpu_devfreq_paths()) {
+    add_dvfs_domain(gov, gpu + "/min_freq", gpu + "/max_freq", gpu + "/available_frequencies",
+                    string());
+  }
+
+  for (const auto& domain : dvfs_domains) {
+    unsigned levels = domain.frequencies.size() - 1 - domain.floor_index;
+    gov->max_level = std::max(gov->max_level, levels);
+  }
+
+  debug_log("governing %zu clocks, up to %u steps", dvfs_domains.size(), gov->max_level);
+}
+
+static void governor_apply(const governor_t* gov) {
+  for (const auto& domain : dvfs_domains) {
+    size_t top = domain.frequencies.size() - 1;
+    size_t index = std::max(top > gov->level ? top - gov->level : 0, domain.floor_index);
+    string frequency = std::to_string(domain.frequencies[index]);
+    string value;
+
+    // with max_freq the minimum is pinned to the maximum, it goes down first
+    if (read_value(domain.min_path, &value) && atol(value.c_str()) > domain.frequencies[index]) {
+      write_value(domain.min_path, frequency);
+    }
+
+    if (!write_value(domain.max_path, frequency)) {
+      daemon_log(LOG_WARNING, "cannot limit `%s' to %s", domain.max_path.c_str(),
+                 frequency.c_str());
+    }
+  }
+}
+
+/*
+ * Put back the limits saved when the governor engaged, the maxima go up first
+ */
+void governor_restore() {
+  for (const auto& domain : dvfs_domains) {
+    write_value(domain.max_path, domain.saved_max);
+    write_value(domain.min_path, domain.saved_min);
+  }
+
+  dvfs_domains.clear();
+}
+
+/*
+ * Called every tick with the pwm written to the fan
+ * returns true when the clock limits changed
+ */
+bool governor_update(governor_t* gov, unsigned temp, unsigned pwm, unsigned pwm_cap) {
+  // the clocks are capped while the fan is stalled, stay out of the way
+  if (!capped_values.empty()) return false;
+
+  if (gov->wait > 0) {
+    gov->wait--;
+    return false;
+  }
+
+  if (temp >= gov->trigger && pwm >= pwm_cap) {
+    if (gov->level == 0) governor_setup(gov);
+    if (gov->level >= gov->max_level) return false;
+
+    gov->level++;
+    gov->steps_down++;
+    daemon_log(LOG_WARNING, "fan at full speed and %u.%03u C, clocks down to step %u/%u",
+               temp / 1000, temp % 1000, gov->level, gov->max_level);
+  } else if (temp <= gov->release && gov->level > 0) {
+    gov->level--;
+    daemon_log(LOG_INFO, "%u.%03u C, clocks up to step %u/%u", temp / 1000, temp % 1000,
+               gov->level, gov->max_level);
+  } else {
+    return false;
+  }
+
+  if (gov->level == 0) {
+    governor_restore();
+  } else {
+    governor_apply(gov);
+  }
+
+  gov->wait = gov->hold;
+  return true;
+}
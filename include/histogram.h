@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#include "log.h"
+
+using std::string;
+
+/*
+ * Log-linear buckets: values below HISTOGRAM_LINEAR are exact, above that
+ * every power of two is split into HISTOGRAM_LINEAR buckets, so a bucket
+ * is never wider than 1/HISTOGRAM_LINEAR of its value
+ */
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_LINEAR (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (HISTOGRAM_LINEAR * (32 - HISTOGRAM_SUB_BITS + 1))
+
+/*
+ * Fixed size, recording never allocates. Values in microseconds.
+ */
+typedef struct {
+  uint32_t counts[HISTOGRAM_BUCKETS] = {};
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  uint32_t max = 0;
+} histogram_t;
+
+static inline unsigned histogram_bucket(uint32_t value) {
+  if (value < HISTOGRAM_LINEAR) return value;
+
+  unsigned shift = 31 - __builtin_clz(value) - HISTOGRAM_SUB_BITS;
+  return HISTOGRAM_LINEAR * (shift + 1) + ((value >> shift) - HISTOGRAM_LINEAR);
+}
+
+// largest value that falls in `bucket'
+static inline uint64_t histogram_bucket_max(unsigned bucket) {
+  if (bucket < HISTOGRAM_LINEAR) return bucket;
+
+  unsigned shift = bucket / HISTOGRAM_LINEAR - 1;
+  uint64_t base = uint64_t(HISTOGRAM_LINEAR + bucket % HISTOGRAM_LINEAR) << shift;
+  return base + (uint64_t(1) << shift) - 1;
+}
+
+inline void histogram_record(histogram_t* h, int64_t value) {
+  uint32_t v = uint32_t(std::clamp<int64_t>(value, 0, UINT32_MAX));
+
+  h->counts[histogram_bucket(v)]++;
+  h->count++;
+  h->sum += v;
+  h->max = std::max(h->max, v);
+}
+
+void histogram_reset(histogram_t* h) {
+  memset(h->counts, 0, sizeof(h->counts));
+  h->count = 0;
+  h->sum = 0;
+  h->max = 0;
+}
+
+/*
+ * Upper bound of the `percent' percentile, never above the largest value seen
+ */
+uint64_t histogram_percentile(const histogram_t* h, double percent) {
+  if (h->count == 0) return 0;
+
+  uint64_t rank = std::max<uint64_t>(uint64_t(h->count * percent / 100 + 0.5), 1);
+  uint64_t seen = 0;
+
+  for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) return std::min<uint64_t>(histogram_bucket_max(i), h->max);
+  }
+
+  return h->max;
+}
+
+string format_histogram_text(const char* name, const histogram_t* h) {
+  return string_format("  %-18s %8llu  %7llu %7llu %7llu %7llu %8u\n", name,
+                       (unsigned long long)h->count,
+                       (unsigned long long)(h->count ? h->sum / h->count : 0),
+                       (unsigned long long)histogram_percentile(h, 50),
+                       (unsigned long long)histogram_percentile(h, 90),
+                       (unsigned long long)histogram_percentile(h, 99), h->max);
+}
+
+string format_histogram_json(const histogram_t* h) {
+  return string_format("{\"count\":%llu,\"mean\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,"
+                       "\"max\":%u}",
+                       (unsigned long long)h->count,
+                       (unsigned long long)(h->count ? h->sum / h->count : 0),
+                       (unsigned long long)histogram_percentile(h, 50),
+                       (unsigned long long)histogram_percentile(h, 90),
+                       (unsigned long long)histogram_percentile(h, 99), h->max);
+}
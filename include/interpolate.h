@@ -1,32 +1,108 @@
 #pragma once
 
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
 #include <vector>
 
 using std::vector;
 
+/*
+ * Fan speeds in the compiled curve are stored in hundredths of a percent
+ */
+#define CURVE_SPEED_SCALE 100
+
 typedef struct {
   unsigned x;
   unsigned y;
 } coord_t;
 
-unsigned interpolate(vector<coord_t> c, unsigned x) {
-  unsigned min_x = c[0].x;
-  unsigned max_x = c[c.size() - 1].x;
-
-  if (x <= min_x) {
-    return c[0].y;
-  } else if (x >= max_x) {
-    return c[c.size() - 1].y;
-  } else {
-    for (int i = 0; i < c.size() - 1; i++) {
-      if (c[i].x <= x && c[i + 1].x >= x) {
-        unsigned diffx = x - c[i].x;
-        unsigned diffn = c[i + 1].x - c[i].x;
-
-        return c[i].y + (c[i + 1].y - c[i].y) * diffx / diffn;
-      }
+/*
+ * The table compiled into a flat lookup table, indexed by
+ * (temperature - min_temp) / step, all temperatures in millidegrees
+ */
+typedef struct {
+  unsigned min_temp = 0;
+  unsigned max_temp = 0;
+  unsigned step = 100;
+  vector<uint16_t> speed;
+} fan_curve_t;
+
+/*
+ * Interpolate the table at a millidegree temperature,
+ * returns the speed in hundredths of a percent
+ */
+unsigned interpolate_milli(const vector<coord_t>& c, unsigned temp) {
+  long t = temp;
+
+  if (t <= long(c[0].x) * 1000) {
+    return c[0].y * CURVE_SPEED_SCALE;
+  }
+
+  for (size_t i = 0; i + 1 < c.size(); i++) {
+    long x0 = long(c[i].x) * 1000;
+    long x1 = long(c[i + 1].x) * 1000;
+
+    if (t >= x0 && t <= x1) {
+      long y0 = long(c[i].y) * CURVE_SPEED_SCALE;
+      long y1 = long(c[i + 1].y) * CURVE_SPEED_SCALE;
+
+      if (x1 == x0) return y1;
+      return y0 + (y1 - y0) * (t - x0) / (x1 - x0);
     }
   }
 
-  return 0;  // this should never occur
+  return c[c.size() - 1].y * CURVE_SPEED_SCALE;
+}
+
+/*
+ * Compile the table into a lookup table with a resolution of `step' millidegrees
+ */
+fan_curve_t compile_curve(const vector<coord_t>& c, unsigned step) {
+  fan_curve_t curve;
+
+  curve.step = std::max(step, 1u);
+  curve.min_temp = c[0].x * 1000;
+  curve.max_temp = std::max(c[c.size() - 1].x * 1000, curve.min_temp);
+
+  size_t size = (curve.max_temp - curve.min_temp) / curve.step + 1;
+  curve.speed.resize(size);
+
+  for (size_t i = 0; i < size; i++) {
+    curve.speed[i] = interpolate_milli(c, curve.min_temp + i * curve.step);
+  }
+
+  return curve;
+}
+
+/*
+ * Index into the compiled curve, temperatures outside the table are clamped
+ */
+inline size_t curve_index(const fan_curve_t& curve, unsigned temp) {
+  if (temp <= curve.min_temp) return 0;
+
+  size_t index = (temp - curve.min_temp) / curve.step;
+  return std::min(index, curve.speed.size() - 1);
+}
+
+/*
+ * Fan speed (in hundredths of a percent) for a millidegree temperature
+ */
+inline unsigned curve_lookup(const fan_curve_t& curve, unsigned temp) {
+  return curve.speed[curve_index(curve, temp)];
+}
+
+/*
+ * Print the compiled curve to stdout
+ */
+void dump_curve(const fan_curve_t& curve) {
+  printf("# step: %u mC, entries: %zu\n", curve.step, curve.speed.size());
+  printf("# temperature (C) speed (%%)\n");
+
+  for (size_t i = 0; i < curve.speed.size(); i++) {
+    unsigned temp = curve.min_temp + i * curve.step;
+    printf("%u.%03u %u.%02u\n", temp / 1000, temp % 1000, curve.speed[i] / CURVE_SPEED_SCALE,
+           curve.speed[i] % CURVE_SPEED_SCALE);
+  }
 }
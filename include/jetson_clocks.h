@@ -1,47 +1,381 @@
 #pragma once
 
+#include <glob.h>
 #include <stdio.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <fstream>
+#include <sstream>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include "defines.h"
 #include "log.h"
 #include "utils.h"
 
 using std::string;
+using std::vector;
+
+/*
+ * Native implementation of `jetson_clocks --store', `jetson_clocks' and
+ * `jetson_clocks --restore'. State files use the same `path:value' format,
+ * so files written by either one can be restored by the other.
+ */
+
+static vector<string> glob_paths(const char* pattern) {
+  vector<string> result;
+  glob_t glob_result;
+
+  if (glob(pattern, 0, NULL, &glob_result) == 0) {
+    for (size_t i = 0; i < glob_result.gl_pathc; i++) {
+      result.push_back(glob_result.gl_pathv[i]);
+    }
+  }
+
+  globfree(&glob_result);
+
+  return result;
+}
+
+/*
+ * Read a sysfs value without the trailing newline
+ * returns false if the file cannot be read
+ */
+static bool read_value(const string& path, string* value) {
+  std::ifstream in_stream(path);
+
+  if (!in_stream || !std::getline(in_stream, *value)) {
+    return false;
+  }
+
+  trim(*value);
+  return true;
+}
+
+/*
+ * Write a sysfs value, sysfs reports errors on flush
+ * returns false on failure
+ */
+static bool write_value(const string& path, const string& value) {
+  std::ofstream out_stream(path, std::ios::out);
+
+  if (!out_stream) {
+    return false;
+  }
+
+  out_stream << value << std::flush;
+  return out_stream.good();
+}
+
+static bool is_soc_family(const char* family) {
+  if (access(SOC_FAMILY_PATH, R_OK) != 0) return false;
+
+  // compatible is a list of NUL separated strings
+  return read_file(SOC_FAMILY_PATH).find(family) != string::npos;
+}
+
+static bool is_tegra210() { return is_soc_family(TEGRA_210); }
+
+// the emc clock is set through the bpmp
+static bool is_tegra_bpmp() { return is_soc_family(TEGRA_186) || is_soc_family(TEGRA_194); }
+
+static bool is_gpu_devfreq(const string& path) {
+  string name = path.substr(path.rfind('/') + 1);
+
+  return name.find("gpu") != string::npos || name.find("gp10b") != string::npos ||
+         name.find("gv11b") != string::npos || name.find("ga10b") != string::npos;
+}
+
+static vector<string> gpu_devfreq_paths() {
+  vector<string> result;
+
+  for (const auto& path : glob_paths(GPU_GLOB)) {
+    if (is_gpu_devfreq(path)) {
+      result.push_back(path);
+    }
+  }
+
+  return result;
+}
+
+/*
+ * Every file saved by store_config, in the order it has to be restored
+ */
+static vector<string> clock_state_paths() {
+  vector<string> paths;
+  vector<string> cpus = glob_paths(CPU_GLOB);
+
+  // cpus must be online before their frequencies can be set
+  for (const auto& cpu : cpus) {
+    paths.push_back(cpu + "/online");
+  }
+
+  // maxima before minima, a minimum above the maximum is rejected
+  for (const auto& cpu : cpus) {
+    paths.push_back(cpu + "/cpufreq/scaling_max_freq");
+  }
+
+  for (const auto& cpu : cpus) {
+    paths.push_back(cpu + "/cpufreq/scaling_min_freq");
+  }
+
+  for (const auto& state : glob_paths(CPU_IDLE_STATE_GLOB)) {
+    paths.push_back(state);
+  }
+
+  for (const auto& gpu : gpu_devfreq_paths()) {
+    paths.push_back(gpu + "/max_freq");
+    paths.push_back(gpu + "/min_freq");
+    paths.push_back(gpu + "/device/railgate_enable");
+  }
+
+  if (is_tegra210()) {
+    paths.push_back(TEGRA_210_EMC_FREQ_OVERRIDE_PATH);
+  } else if (is_tegra_bpmp()) {
+    paths.push_back(BPMP_EMC_FREQ_OVERRIDE_PATH);
+  }
+
+  paths.push_back(TARGET_PWM_PATH);
+  paths.push_back(TEMP_CONTROL_PATH);
+
+  return paths;
+}
 
 void store_config(const char* path) {
   // save config
-  string full_command = "jetson_clocks --store ";
-  full_command += path;
-  if (system(full_command.c_str()) == 0) {
-    // success
-  } else {
+  std::ofstream out_stream(path, std::ios::out);
+
+  if (!out_stream) {
     daemon_log(LOG_ERR, "cannot save config file `%s'", path);
     exit(EXIT_FAILURE);
   }
+
+  unsigned count = 0;
+  for (const auto& state_path : clock_state_paths()) {
+    string value;
+
+    if (read_value(state_path, &value)) {
+      out_stream << state_path << ":" << value << "\n";
+      count++;
+    }
+  }
+
+  out_stream.flush();
+  if (!out_stream.good()) {
+    daemon_log(LOG_ERR, "cannot save config file `%s'", path);
+    exit(EXIT_FAILURE);
+  }
+
+  debug_log("stored %u values into `%s'", count, path);
   return;
 }
 
+/*
+ * Restore a state file, errors are logged and skipped
+ * so everything that can be restored is restored
+ */
 void restore_config(const char* path) {
   // reload from file
-  string full_command = "jetson_clocks --restore ";
-  full_command += path;
-  if (system(full_command.c_str()) == 0) {
-    return;
-  } else {
+  std::ifstream in_stream(path);
+  string line;
+  unsigned failed = 0;
+
+  if (!in_stream) {
     daemon_log(LOG_ERR, "cannot restore config file `%s'", path);
-    exit(EXIT_FAILURE);
+    return;
+  }
+
+  while (std::getline(in_stream, line)) {
+    // values never contain `:', paths might
+    size_t separator = line.rfind(':');
+    if (separator == string::npos) continue;
+
+    string state_path = line.substr(0, separator);
+    string value = line.substr(separator + 1);
+
+    if (!write_value(state_path, value)) {
+      debug_log("cannot restore `%s' to `%s'", state_path.c_str(), value.c_str());
+      failed++;
+    }
+  }
+
+  if (failed > 0) {
+    daemon_log(LOG_WARNING, "%u values from `%s' could not be restored", failed, path);
   }
+
   return;
 }
 
 void clocks_max_freq() {
   // set all to max freq
-  if (system("jetson_clocks") == 0) {
-    // success
-  } else {
-    daemon_log(LOG_ERR, "cannot set max frequency");
-    exit(EXIT_FAILURE);
+  vector<string> cpus = glob_paths(CPU_GLOB);
+  string value;
+
+  for (const auto& cpu : cpus) {
+    string online = cpu + "/online";
+    if (access(online.c_str(), F_OK) == 0 && !write_value(online, "1")) {
+      daemon_log(LOG_WARNING, "cannot bring `%s' online", cpu.c_str());
+    }
+  }
+
+  for (const auto& cpu : cpus) {
+    if (read_value(cpu + "/cpufreq/scaling_max_freq", &value) &&
+        !write_value(cpu + "/cpufreq/scaling_min_freq", value)) {
+      daemon_log(LOG_WARNING, "cannot set the frequency of `%s'", cpu.c_str());
+    }
+  }
+
+  // keep state0 (WFI) enabled, disable the deeper idle states
+  for (const auto& state : glob_paths(CPU_IDLE_STATE_GLOB)) {
+    if (state.find("/state0/") == string::npos) {
+      write_value(state, "1");
+    }
   }
+
+  for (const auto& gpu : gpu_devfreq_paths()) {
+    write_value(gpu + "/device/railgate_enable", "0");
+
+    if (read_value(gpu + "/max_freq", &value) && !write_value(gpu + "/min_freq", value)) {
+      daemon_log(LOG_WARNING, "cannot set the frequency of `%s'", gpu.c_str());
+    }
+  }
+
+  if (is_tegra210()) {
+    if (read_value(TEGRA_210_EMC_MAX_FREQ_PATH, &value) &&
+        write_value(TEGRA_210_EMC_UPDATE_FREQ_PATH, value)) {
+      write_value(TEGRA_210_EMC_FREQ_OVERRIDE_PATH, "1");
+    } else {
+      daemon_log(LOG_WARNING, "cannot set the emc frequency");
+    }
+  } else if (is_tegra_bpmp()) {
+    string cap;
+    bool has_max = read_value(BPMP_EMC_MAX_FREQ_PATH, &value);
+
+    // nvpmodel can cap the emc below its maximum for isochronous clients
+    if (has_max && read_value(BPMP_EMC_ISO_CAP_PATH, &cap)) {
+      long long cap_rate = strtoll(cap.c_str(), NULL, 10);
+      if (cap_rate > 0 && cap_rate < strtoll(value.c_str(), NULL, 10)) value = cap;
+    }
+
+    if (has_max && write_value(BPMP_EMC_UPDATE_FREQ_PATH, value)) {
+      write_value(BPMP_EMC_FREQ_OVERRIDE_PATH, "1");
+    } else {
+      daemon_log(LOG_WARNING, "cannot set the emc frequency");
+    }
+  }
+
   return;
 }
+
+typedef struct {
+  string last;
+  unsigned stable_reads = 0;
+} freq_settle_t;
+
+/*
+ * The maximum frequencies allowed by the current power model
+ */
+static string clocks_max_snapshot() {
+  string snapshot;
+  string value;
+
+  for (const auto& cpu : glob_paths(CPU_GLOB)) {
+    if (read_value(cpu + "/cpufreq/scaling_max_freq", &value)) {
+      snapshot += value + " ";
+    }
+  }
+
+  for (const auto& gpu : gpu_devfreq_paths()) {
+    if (read_value(gpu + "/max_freq", &value)) {
+      snapshot += value + " ";
+    }
+  }
+
+  return snapshot;
+}
+
+/*
+ * nvpmodel is done once the maximum frequencies stop changing
+ * returns true after FREQ_SETTLE_READS identical reads in a row
+ */
+bool clocks_settled(freq_settle_t* settle) {
+  string snapshot = clocks_max_snapshot();
+
+  if (snapshot == settle->last) {
+    settle->stable_reads++;
+  } else {
+    debug_log("maximum frequencies changed: %s", snapshot.c_str());
+    settle->last = snapshot;
+    settle->stable_reads = 0;
+  }
+
+  return settle->stable_reads >= FREQ_SETTLE_READS;
+}
+
+// limits changed by clocks_cap_freq, in the order they were written
+static vector<std::pair<string, string>> capped_values;
+
+static void cap_value(const string& path, const string& value) {
+  string old_value;
+
+  if (read_value(path, &old_value) && write_value(path, value)) {
+    capped_values.push_back({path, old_value});
+  } else {
+    daemon_log(LOG_WARNING, "cannot cap `%s'", path.c_str());
+  }
+}
+
+/*
+ * Pin every cpu and gpu to its lowest frequency, to protect the board
+ * while it cannot be cooled. The previous limits are kept for clocks_uncap_freq
+ */
+void clocks_cap_freq() {
+  string value;
+
+  if (!capped_values.empty()) return;
+
+  for (const auto& cpu : glob_paths(CPU_GLOB)) {
+    if (read_value(cpu + "/cpufreq/cpuinfo_min_freq", &value)) {
+      cap_value(cpu + "/cpufreq/scaling_min_freq", value);
+      cap_value(cpu + "/cpufreq/scaling_max_freq", value);
+    }
+  }
+
+  for (const auto& gpu : gpu_devfreq_paths()) {
+    if (read_value(gpu + "/available_frequencies", &value)) {
+      std::istringstream frequencies(value);
+      long frequency, lowest = -1;
+
+      // the list is sorted, but do not rely on it
+      while (frequencies >> frequency) {
+        if (lowest < 0 || frequency < lowest) lowest = frequency;
+      }
+
+      if (lowest < 0) continue;
+
+      cap_value(gpu + "/min_freq", std::to_string(lowest));
+      cap_value(gpu + "/max_freq", std::to_string(lowest));
+    }
+  }
+
+  daemon_log(LOG_WARNING, "clocks capped to their minimum");
+}
+
+/*
+ * Undo clocks_cap_freq, the maxima are raised before the minima
+ */
+void clocks_uncap_freq() {
+  if (capped_values.empty()) return;
+
+  for (auto it = capped_values.rbegin(); it != capped_values.rend(); ++it) {
+    if (!write_value(it->first, it->second)) {
+      daemon_log(LOG_WARNING, "cannot restore `%s' to `%s'", it->first.c_str(),
+                 it->second.c_str());
+    }
+  }
+
+  capped_values.clear();
+  daemon_log(LOG_INFO, "clock limits restored");
+}
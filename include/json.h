@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+
+using std::string;
+
+/*
+ * The JSON string form of `c' in `code', returns its length
+ */
+static inline size_t json_escape_char(char c, char code[8]) {
+  if (c == '"' || c == '\\') {
+    code[0] = '\\';
+    code[1] = c;
+    return 2;
+  } else if ((unsigned char)c < 0x20) {
+    return snprintf(code, 8, "\\u%04x", c);
+  }
+
+  code[0] = c;
+  return 1;
+}
+
+/*
+ * Append `text' to `out' escaped for a JSON string, without the quotes
+ */
+static void json_escape(string* out, const char* text) {
+  char code[8];
+
+  for (const char* c = text; *c; c++) {
+    out->append(code, json_escape_char(*c, code));
+  }
+}
+
+/*
+ * `text' escaped for a JSON string, without the quotes
+ */
+static inline string json_string(const string& text) {
+  string out;
+  json_escape(&out, text.c_str());
+  return out;
+}
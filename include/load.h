@@ -0,0 +1,156 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#include "defines.h"
+#include "interpolate.h"
+#include "jetson_clocks.h"
+#include "log.h"
+#include "sensor_io.h"
+
+using std::string;
+
+#define LOAD_READ_BUFFER_SIZE 256
+
+typedef struct {
+  double cpu_weight = 0.2;  // percent of fan speed per percent of cpu load
+  double gpu_weight = 0.3;  // percent of fan speed per percent of gpu load
+  double psi_weight = 0;    // percent of fan speed per percent of cpu pressure
+  unsigned max_boost = 30;  // percent of fan speed
+
+  sensor_t proc_stat;
+  sensor_t gpu_load;
+  sensor_t cpu_pressure;
+
+  uint64_t last_busy = 0;
+  uint64_t last_total = 0;
+
+  // last readings, in percent
+  double cpu = 0;
+  double gpu = 0;
+  double psi = 0;
+} load_t;
+
+/*
+ * Open the load sources, missing ones are skipped
+ */
+void load_open(load_t* load) {
+  load->proc_stat.path = PROC_STAT_PATH;
+  load->cpu_pressure.path = CPU_PRESSURE_PATH;
+
+  if (!sensor_open(&load->proc_stat)) {
+    daemon_log(LOG_WARNING, "cannot open `%s', cpu load is disabled", PROC_STAT_PATH);
+  }
+
+  if (load->psi_weight > 0 && !sensor_open(&load->cpu_pressure)) {
+    daemon_log(LOG_WARNING, "cannot open `%s', cpu pressure is disabled", CPU_PRESSURE_PATH);
+  }
+
+  // devfreq load of the gpu is 0 - 1000
+  for (const auto& gpu : gpu_devfreq_paths()) {
+    load->gpu_load.path = gpu + "/device/load";
+    if (sensor_open(&load->gpu_load)) {
+      debug_log("using gpu load from `%s'", load->gpu_load.path.c_str());
+      break;
+    }
+  }
+}
+
+/*
+ * CPU utilization since the previous call, from the aggregate line of /proc/stat
+ */
+static bool read_cpu_load(load_t* load) {
+  char buf[LOAD_READ_BUFFER_SIZE];
+  uint64_t fields[8] = {0};
+  char* p = buf;
+
+  if (load->proc_stat.fd < 0 || sensor_read_text(&load->proc_stat, buf, sizeof(buf)) <= 0) {
+    return false;
+  }
+
+  // cpu  user nice system idle iowait irq softirq steal
+  if (strncmp(p, "cpu ", 4) != 0) return false;
+  p += 4;
+
+  for (int i = 0; i < 8; i++) {
+    fields[i] = strtoull(p, &p, 10);
+  }
+
+  uint64_t idle = fields[3] + fields[4];
+  uint64_t total = 0;
+  for (int i = 0; i < 8; i++) total += fields[i];
+  uint64_t busy = total - idle;
+
+  if (load->last_total > 0 && total > load->last_total) {
+    load->cpu = 100.0 * (busy - load->last_busy) / (total - load->last_total);
+  }
+
+  load->last_busy = busy;
+  load->last_total = total;
+
+  return true;
+}
+
+/*
+ * The 10 second average of `some' cpu pressure
+ */
+static bool read_cpu_pressure(load_t* load) {
+  char buf[LOAD_READ_BUFFER_SIZE];
+
+  if (load->cpu_pressure.fd < 0 ||
+      sensor_read_text(&load->cpu_pressure, buf, sizeof(buf)) <= 0) {
+    return false;
+  }
+
+  // some avg10=1.23 avg60=0.50 avg300=0.10 total=12345
+  const char* avg10 = strstr(buf, "avg10=");
+  if (!avg10) return false;
+
+  load->psi = strtod(avg10 + strlen("avg10="), NULL);
+  return true;
+}
+
+static bool read_gpu_load(load_t* load) {
+  int value;
+
+  if (load->gpu_load.fd < 0 || !sensor_try_read_int(&load->gpu_load, &value)) {
+    return false;
+  }
+
+  load->gpu = value / 10.0;
+  return true;
+}
+
+/*
+ * Read every load source
+ */
+void load_sample(load_t* load) {
+  read_cpu_load(load);
+  read_gpu_load(load);
+  if (load->psi_weight > 0) read_cpu_pressure(load);
+}
+
+/*
+ * The highest of the cpu and gpu load in percent
+ */
+double load_max(const load_t* load) { return std::max(load->cpu, load->gpu); }
+
+/*
+ * The fan speed boost for the last sample in hundredths of a percent,
+ * rounded down to whole percents so small load changes don't rewrite the pwm
+ */
+unsigned load_boost(const load_t* load) {
+  double boost =
+      load->cpu_weight * load->cpu + load->gpu_weight * load->gpu + load->psi_weight * load->psi;
+  boost = std::clamp(boost, 0.0, double(load->max_boost));
+
+  debug_log("feed-forward: cpu %.1f%% gpu %.1f%% psi %.2f -> +%.2f%%", load->cpu, load->gpu,
+            load->psi, boost);
+
+  return unsigned(boost) * CURVE_SPEED_SCALE;
+}
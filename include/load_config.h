@@ -4,37 +4,238 @@
 
 #include <string>
 
+#include "characterize.h"
 #include "defines.h"
+#include "filter.h"
 #include "log.h"
 
 using std::string;
 
 enum options_enum {
   OPTION_DEBUG = 256,
+  OPTION_DUMP_CURVE,
+  OPTION_JSON,
+  OPTION_CHARACTERIZE,
+  OPTION_SIMULATE,
+  OPTION_CSV,
+  OPTION_ROOT,
+  OPTION_TICKS,
+  OPTION_DUMP,
+  OPTION_RESET_LATENCY,
+  OPTION_TRACE,
 };
 
+enum control_mode_enum {
+  MODE_TABLE,
+  MODE_MPC,
+  MODE_PID,
+  MODE_RPM,
+};
+
+static const char* control_mode_names[] = {"table", "mpc", "pid", "rpm"};
+
 typedef struct options_struct {
   bool help = false;
   bool version = false;
   bool check = false;
   bool status = false;
+  bool json = false;
+  bool watch = false;
+  bool dump_curve = false;
+  bool dump = false;
+  bool reset_latency = false;
+  bool print_trace = false;
+  bool characterize = false;
+  bool simulate = false;
+  string csv_path;  // CHARACTERIZE_CSV_PATH if empty
+  unsigned long ticks = 1000;
+  sweep_config_t sweep;
+  bool sweep_load = true;
   bool use_highest = false;
   string substring = "PMIC";
+  string include_sensors = "";
+  string sensor_weights = "";
+  string zone_tables = "";
+  filter_config_t filter;
+  unsigned hysteresis = 0;
+  unsigned pwm_min_delta = 0;
+  unsigned pwm_slew_up = 0;
+  unsigned pwm_slew_down = 0;
+  unsigned spinup_kick = 0;
+  unsigned rpm_max = 5000;
+  double rpm_ki = 0.01;
+  unsigned stall_rpm = 100;
+  unsigned stall_ticks = 5;
+  bool stall_protect = false;
+  bool dvfs_governor = false;
+  unsigned dvfs_trigger = 80000;
+  unsigned dvfs_release = 75000;
+  unsigned dvfs_hold = 3;
+  unsigned dvfs_floor = 50;
   unsigned interval = 2;
+  unsigned table_step = 100;
+  bool adaptive_interval = false;
+  unsigned min_interval = 100;
+  unsigned max_interval = 10000;
+  unsigned slope_high = 500;
+  unsigned slope_low = 50;
+  unsigned steep_segment = 5;
+  bool event_driven = false;
+  unsigned event_window = 1000;
+  unsigned event_timeout = 60;
+  bool telemetry = true;
+  bool recorder = false;
+  unsigned recorder_flush = 600;
+  unsigned recorder_file_size = 1024;
+  unsigned recorder_file_age = 24;
+  unsigned recorder_files = 30;
+  bool trace = false;
+  unsigned trace_events = 10000;
+  bool feedforward = false;
+  double ff_cpu_weight = 0.2;
+  double ff_gpu_weight = 0.3;
+  double ff_psi_weight = 0;
+  unsigned ff_max_boost = 30;
+  control_mode_enum mode = MODE_TABLE;
+  unsigned mpc_ceiling = 70000;
+  unsigned mpc_horizon = 60;
+  double mpc_forgetting = 0.995;
+  unsigned pid_setpoint = 60000;
+  double pid_kp = 2.0;
+  double pid_ki = 0.05;
+  double pid_kd = 10.0;
+  double pid_d_filter = 5.0;
+  bool throttle_adapt = false;
+  unsigned throttle_step = 500;
+  unsigned throttle_max_offset = 10000;
+  unsigned throttle_decay = 10;
 } options_t;
 
-void load_config(options_t* oobj) {
-  INIReader reader(CONFIG_FILE_PATH);
+/*
+ * Load the config file at `path' into `oobj'
+ * returns false if the file cannot be read or has a syntax error
+ */
+bool load_config(options_t* oobj, const char* path = CONFIG_FILE_PATH) {
+  INIReader reader(path);
 
   if (reader.ParseError() < 0) {
-    debug_log("cannot load config %s", CONFIG_FILE_PATH);
-    sprintf_stderr("%s: cannot load config %s", argv0, CONFIG_FILE_PATH);
+    debug_log("cannot load config %s", path);
+    sprintf_stderr("%s: cannot load config %s", argv0, path);
   }
 
   oobj->substring = reader.Get("", "ignore_sensors", "PMIC");
+  oobj->include_sensors = reader.Get("", "include_sensors", "");
+  oobj->sensor_weights = reader.Get("", "sensor_weights", "");
+  oobj->zone_tables = reader.Get("", "zone_tables", "");
+  oobj->filter.median_window = reader.GetInteger("", "filter_median", 1);
+  oobj->filter.ema_alpha = reader.GetReal("", "filter_ema", 1.0);
+  oobj->filter.max_rate = reader.GetInteger("", "filter_max_rate", 0);
+  oobj->filter.min_temp = reader.GetInteger("", "sensor_min_temp", -30000);
+  oobj->filter.max_temp = reader.GetInteger("", "sensor_max_temp", 99000);
+  oobj->filter.stuck_ticks = reader.GetInteger("", "stuck_ticks", 0);
+  oobj->filter.readmit_ticks = reader.GetInteger("", "readmit_ticks", 5);
+
+  oobj->hysteresis = reader.GetInteger("", "hysteresis", 0);
+  oobj->pwm_min_delta = reader.GetInteger("", "pwm_min_delta", 0);
+  oobj->pwm_slew_up = reader.GetInteger("", "pwm_slew_up", 0);
+  oobj->pwm_slew_down = reader.GetInteger("", "pwm_slew_down", 0);
+  oobj->spinup_kick = reader.GetInteger("", "spinup_kick", 0);
+  oobj->sweep.target = reader.GetInteger("", "characterize_target", 65000);
+  oobj->sweep.band = reader.GetInteger("", "characterize_band", 10000);
+  oobj->sweep.ambient = reader.GetInteger("", "characterize_ambient", 25000);
+  oobj->sweep.limit = reader.GetInteger("", "characterize_limit", 85000);
+  oobj->sweep.steps = reader.GetInteger("", "characterize_steps", 10);
+  oobj->sweep.settle = reader.GetInteger("", "characterize_settle", 600);
+  oobj->sweep_load = reader.GetBoolean("", "characterize_load", true);
+  oobj->rpm_max = reader.GetInteger("", "rpm_max", 5000);
+  oobj->rpm_ki = reader.GetReal("", "rpm_ki", 0.01);
+  oobj->stall_rpm = reader.GetInteger("", "stall_rpm", 100);
+  oobj->stall_ticks = reader.GetInteger("", "stall_ticks", 5);
+  oobj->stall_protect = reader.GetBoolean("", "stall_protect", false);
+  oobj->dvfs_governor = reader.GetBoolean("", "dvfs_governor", false);
+  oobj->dvfs_trigger = reader.GetInteger("", "dvfs_trigger", 80000);
+  oobj->dvfs_release = reader.GetInteger("", "dvfs_release", 75000);
+  oobj->dvfs_hold = reader.GetInteger("", "dvfs_hold", 3);
+  oobj->dvfs_floor = reader.GetInteger("", "dvfs_floor", 50);
+
+  if (oobj->dvfs_release >= oobj->dvfs_trigger) {
+    daemon_log(LOG_WARNING, "dvfs_release must be below dvfs_trigger, using %u",
+               oobj->dvfs_trigger - 5000);
+    oobj->dvfs_release = oobj->dvfs_trigger - 5000;
+  }
+
+  if (oobj->filter.median_window > FILTER_MAX_WINDOW) {
+    daemon_log(LOG_WARNING, "filter_median is limited to %d samples", FILTER_MAX_WINDOW);
+  }
+
+  if (oobj->filter.ema_alpha <= 0 || oobj->filter.ema_alpha > 1) {
+    daemon_log(LOG_WARNING, "filter_ema must be between 0 and 1, disabling it");
+    oobj->filter.ema_alpha = 1.0;
+  }
   // average is the opposite of use_highest, so invert
   oobj->use_highest = !reader.GetBoolean("", "average", false);
   oobj->interval = reader.GetInteger("", "interval", 2);
+  long table_step = reader.GetInteger("", "table_step", 100);
+  if (table_step <= 0) {
+    daemon_log(LOG_WARNING, "table_step must be positive, using 100");
+    table_step = 100;
+  }
+  oobj->table_step = table_step;
+  oobj->adaptive_interval = reader.GetBoolean("", "adaptive_interval", false);
+  oobj->min_interval = reader.GetInteger("", "min_interval", 100);
+  oobj->max_interval = reader.GetInteger("", "max_interval", 10000);
+  oobj->slope_high = reader.GetInteger("", "slope_high", 500);
+  oobj->slope_low = reader.GetInteger("", "slope_low", 50);
+  oobj->steep_segment = reader.GetInteger("", "steep_segment", 5);
+  oobj->event_driven = reader.GetBoolean("", "event_driven", false);
+  oobj->event_window = reader.GetInteger("", "event_window", 1000);
+  oobj->event_timeout = reader.GetInteger("", "event_timeout", 60);
+  oobj->telemetry = reader.GetBoolean("", "telemetry", true);
+  oobj->recorder = reader.GetBoolean("", "recorder", false);
+  oobj->recorder_flush = reader.GetInteger("", "recorder_flush", 600);
+  oobj->recorder_file_size = reader.GetInteger("", "recorder_file_size", 1024);
+  oobj->recorder_file_age = reader.GetInteger("", "recorder_file_age", 24);
+  oobj->recorder_files = reader.GetInteger("", "recorder_files", 30);
+  oobj->trace = reader.GetBoolean("", "trace", false);
+  oobj->trace_events = reader.GetInteger("", "trace_events", 10000);
+  oobj->feedforward = reader.GetBoolean("", "feedforward", false);
+  oobj->ff_cpu_weight = reader.GetReal("", "ff_cpu_weight", 0.2);
+  oobj->ff_gpu_weight = reader.GetReal("", "ff_gpu_weight", 0.3);
+  oobj->ff_psi_weight = reader.GetReal("", "ff_psi_weight", 0);
+  oobj->ff_max_boost = reader.GetInteger("", "ff_max_boost", 30);
+  oobj->throttle_adapt = reader.GetBoolean("", "throttle_adapt", false);
+  oobj->mpc_ceiling = reader.GetInteger("", "mpc_ceiling", 70000);
+  oobj->mpc_horizon = reader.GetInteger("", "mpc_horizon", 60);
+  oobj->mpc_forgetting = reader.GetReal("", "mpc_forgetting", 0.995);
+  oobj->pid_setpoint = reader.GetInteger("", "pid_setpoint", 60000);
+  oobj->pid_kp = reader.GetReal("", "pid_kp", 2.0);
+  oobj->pid_ki = reader.GetReal("", "pid_ki", 0.05);
+  oobj->pid_kd = reader.GetReal("", "pid_kd", 10.0);
+  oobj->pid_d_filter = reader.GetReal("", "pid_d_filter", 5.0);
+
+  string mode = reader.Get("", "mode", "table");
+  oobj->mode = MODE_TABLE;
+  for (size_t i = 0; i < sizeof(control_mode_names) / sizeof(control_mode_names[0]); i++) {
+    if (mode == control_mode_names[i]) {
+      oobj->mode = control_mode_enum(i);
+      break;
+    }
+  }
+
+  if (mode != control_mode_names[oobj->mode]) {
+    daemon_log(LOG_WARNING, "unknown mode `%s', using table", mode.c_str());
+  }
+
+  oobj->throttle_step = reader.GetInteger("", "throttle_step", 500);
+  oobj->throttle_max_offset = reader.GetInteger("", "throttle_max_offset", 10000);
+  oobj->throttle_decay = reader.GetInteger("", "throttle_decay", 10);
   enable_tach = reader.GetBoolean("", "enable_tach", false);
   enable_max_freq = reader.GetBoolean("", "max_freq", true);
+
+  if (oobj->min_interval > oobj->max_interval) {
+    daemon_log(LOG_WARNING, "min_interval is greater than max_interval, using min_interval");
+    oobj->max_interval = oobj->min_interval;
+  }
+
+  return reader.ParseError() == 0;
 }
@@ -10,6 +10,7 @@
 
 #include "config.h"
 #include "defines.h"
+#include "trace.h"
 
 using std::string;
 
@@ -31,7 +32,16 @@ void daemon_log(int priority, const char* message, ...) {
 }
 
 // TOFO: move to stdout?
+// also an instant event of the trace, when tracing
 void debug_log(const char* message, ...) {
+  if (tracer.enabled) {
+    va_list arglist;
+
+    va_start(arglist, message);
+    trace_instant_v("debug", message, arglist);
+    va_end(arglist);
+  }
+
   if (enable_debug) {
     va_list arglist;
 
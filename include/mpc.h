@@ -0,0 +1,264 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+
+#include "defines.h"
+#include "interpolate.h"
+#include "log.h"
+#include "utils.h"
+
+using std::string;
+
+#define MPC_PARAMS 4
+// the model is only used after this many samples
+#define MPC_MIN_SAMPLES 30
+#define MPC_INITIAL_COVARIANCE 1000.0
+// trace(P) is scaled back to this, the forgetting factor inflates P in
+// the directions a steady workload does not excite
+#define MPC_MAX_COVARIANCE_TRACE (MPC_INITIAL_COVARIANCE * MPC_PARAMS)
+// smallest change of the regressor (degrees, percent) worth an update
+#define MPC_MIN_EXCITATION 0.05
+// fastest believable time constant, in seconds
+#define MPC_MIN_TIME_CONSTANT 1.0
+
+/*
+ * First order thermal model, fitted online with recursive least squares:
+ *
+ *   dT/dt = a * T + b * pwm + c * load + d
+ *
+ * T in degrees, pwm and load in percent, t in seconds.
+ * The time constant is -1 / a and the steady state cooling per percent of pwm is b / a.
+ */
+typedef struct {
+  // settings
+  unsigned ceiling = 70000;  // millidegrees
+  unsigned horizon = 60;     // seconds
+  double forgetting = 0.995;
+
+  double theta[MPC_PARAMS] = {0, 0, 0, 0};
+  double p[MPC_PARAMS][MPC_PARAMS];
+  unsigned long samples = 0;
+
+  // previous tick
+  bool has_last = false;
+  double last_temp = 0;
+  double last_pwm = 0;
+  double last_load = 0;
+  int64_t last_time = 0;
+
+  // regressor of the last update
+  double last_phi[MPC_PARAMS] = {0, 0, 0, 0};
+} mpc_t;
+
+void mpc_reset(mpc_t* mpc) {
+  for (int i = 0; i < MPC_PARAMS; i++) {
+    mpc->theta[i] = 0;
+    for (int j = 0; j < MPC_PARAMS; j++) {
+      mpc->p[i][j] = i == j ? MPC_INITIAL_COVARIANCE : 0;
+    }
+    mpc->last_phi[i] = 0;
+  }
+
+  mpc->samples = 0;
+  mpc->has_last = false;
+}
+
+/*
+ * Finite parameters, a bounded covariance and a believable time constant
+ */
+static bool mpc_sane(const mpc_t* mpc) {
+  double trace = 0;
+
+  for (int i = 0; i < MPC_PARAMS; i++) {
+    if (!std::isfinite(mpc->theta[i])) return false;
+    for (int j = 0; j < MPC_PARAMS; j++) {
+      if (!std::isfinite(mpc->p[i][j])) return false;
+    }
+    trace += mpc->p[i][i];
+  }
+
+  // with some room for the rounding of the scaling in rls_update
+  return trace <= MPC_MAX_COVARIANCE_TRACE * 1.001 && mpc->theta[0] > -1.0 / MPC_MIN_TIME_CONSTANT;
+}
+
+/*
+ * The model can be used if it is stable and the fan actually cools
+ */
+bool mpc_valid(const mpc_t* mpc) {
+  return mpc->samples >= MPC_MIN_SAMPLES && mpc->theta[0] < 0 && mpc->theta[1] < 0 &&
+         mpc_sane(mpc);
+}
+
+double mpc_time_constant(const mpc_t* mpc) {
+  return mpc->theta[0] < 0 ? -1.0 / mpc->theta[0] : 0;
+}
+
+double mpc_gain(const mpc_t* mpc) { return mpc->theta[0] < 0 ? mpc->theta[1] / mpc->theta[0] : 0; }
+
+/*
+ * One recursive least squares step with regressor `phi' and measurement `y'
+ */
+static void rls_update(mpc_t* mpc, const double phi[MPC_PARAMS], double y) {
+  double p_phi[MPC_PARAMS];
+  double denom = mpc->forgetting;
+  double error = y;
+
+  for (int i = 0; i < MPC_PARAMS; i++) {
+    p_phi[i] = 0;
+    for (int j = 0; j < MPC_PARAMS; j++) p_phi[i] += mpc->p[i][j] * phi[j];
+    denom += phi[i] * p_phi[i];
+    error -= mpc->theta[i] * phi[i];
+  }
+
+  for (int i = 0; i < MPC_PARAMS; i++) {
+    mpc->theta[i] += p_phi[i] / denom * error;
+  }
+
+  // P = (P - P phi phi' P / denom) / lambda, P is symmetric
+  double trace = 0;
+  for (int i = 0; i < MPC_PARAMS; i++) {
+    for (int j = 0; j < MPC_PARAMS; j++) {
+      mpc->p[i][j] = (mpc->p[i][j] - p_phi[i] * p_phi[j] / denom) / mpc->forgetting;
+    }
+    trace += mpc->p[i][i];
+  }
+
+  // keep the estimator from winding up
+  if (trace > MPC_MAX_COVARIANCE_TRACE) {
+    double scale = MPC_MAX_COVARIANCE_TRACE / trace;
+    for (int i = 0; i < MPC_PARAMS; i++) {
+      for (int j = 0; j < MPC_PARAMS; j++) mpc->p[i][j] *= scale;
+    }
+  }
+}
+
+/*
+ * Feed the temperature and load measured now,
+ * the pwm is the one passed to mpc_applied on the last tick
+ */
+void mpc_update(mpc_t* mpc, unsigned temp, double load, int64_t time_ms) {
+  double t = temp / 1000.0;
+
+  if (mpc->has_last && time_ms > mpc->last_time) {
+    double dt = (time_ms - mpc->last_time) / 1000.0;
+    double phi[MPC_PARAMS] = {mpc->last_temp, mpc->last_pwm, mpc->last_load, 1};
+    double y = (t - mpc->last_temp) / dt;
+
+    // a regressor that did not move carries nothing new
+    double change = 0;
+    for (int i = 0; i < MPC_PARAMS; i++) change += fabs(phi[i] - mpc->last_phi[i]);
+
+    if (change >= MPC_MIN_EXCITATION || fabs(y) * dt >= MPC_MIN_EXCITATION) {
+      rls_update(mpc, phi, y);
+      std::copy(phi, phi + MPC_PARAMS, mpc->last_phi);
+      mpc->samples++;
+
+      if (!mpc_sane(mpc)) {
+        daemon_log(LOG_WARNING, "thermal model diverged, starting over");
+        mpc_reset(mpc);
+      }
+    }
+  }
+
+  mpc->has_last = true;
+  mpc->last_temp = t;
+  mpc->last_load = load;
+  mpc->last_time = time_ms;
+}
+
+/*
+ * Remember the fan speed (in percent) actually applied, it is the input of the next sample
+ */
+void mpc_applied(mpc_t* mpc, double pwm) { mpc->last_pwm = pwm; }
+
+/*
+ * Temperature predicted after `horizon' seconds with a constant pwm and load
+ */
+double mpc_predict(const mpc_t* mpc, double temp, double pwm, double load) {
+  double a = mpc->theta[0];
+  double steady = -(mpc->theta[1] * pwm + mpc->theta[2] * load + mpc->theta[3]) / a;
+  double decay = exp(a * mpc->horizon);
+
+  return steady + (temp - steady) * decay;
+}
+
+/*
+ * The lowest fan speed (in hundredths of a percent) keeping the predicted
+ * temperature under the ceiling, full speed if none does
+ */
+unsigned mpc_choose(const mpc_t* mpc, unsigned temp, double load) {
+  double ceiling = mpc->ceiling / 1000.0;
+  double t = temp / 1000.0;
+
+  for (unsigned pwm = 0; pwm <= 100; pwm++) {
+    if (mpc_predict(mpc, t, pwm, load) <= ceiling) {
+      return pwm * CURVE_SPEED_SCALE;
+    }
+  }
+
+  return 100 * CURVE_SPEED_SCALE;
+}
+
+/*
+ * Save the fitted model, so it does not have to be learned again after a restart
+ */
+bool mpc_save(const mpc_t* mpc, const char* path) {
+  if (!mpc_sane(mpc)) return false;
+
+  std::ofstream out_stream(path, std::ios::out);
+
+  if (!out_stream) {
+    daemon_log(LOG_WARNING, "cannot save the thermal model to `%s'", path);
+    return false;
+  }
+
+  out_stream.precision(17);
+  out_stream << mpc->samples << "\n";
+
+  for (int i = 0; i < MPC_PARAMS; i++) {
+    out_stream << mpc->theta[i] << (i + 1 < MPC_PARAMS ? " " : "\n");
+  }
+
+  for (int i = 0; i < MPC_PARAMS; i++) {
+    for (int j = 0; j < MPC_PARAMS; j++) {
+      out_stream << mpc->p[i][j] << (j + 1 < MPC_PARAMS ? " " : "\n");
+    }
+  }
+
+  return out_stream.good();
+}
+
+/*
+ * Load a model saved by mpc_save, the model is reset if the file is missing or invalid
+ */
+bool mpc_load(mpc_t* mpc, const char* path) {
+  std::ifstream in_stream(path);
+  mpc_t loaded = *mpc;
+
+  mpc_reset(mpc);
+
+  if (!in_stream) {
+    return false;
+  }
+
+  in_stream >> loaded.samples;
+  for (int i = 0; i < MPC_PARAMS; i++) in_stream >> loaded.theta[i];
+  for (int i = 0; i < MPC_PARAMS; i++) {
+    for (int j = 0; j < MPC_PARAMS; j++) in_stream >> loaded.p[i][j];
+  }
+
+  if (in_stream.fail() || !mpc_sane(&loaded)) {
+    daemon_log(LOG_WARNING, "invalid thermal model `%s', starting over", path);
+    return false;
+  }
+
+  loaded.has_last = false;
+  *mpc = loaded;
+
+  return true;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "log.h"
+
+using std::string;
+
+/*
+ * Minimal sd_notify(3), talks to $NOTIFY_SOCKET without linking libsystemd
+ * returns false if not running under systemd or if the message cannot be sent
+ */
+bool sd_notify(const string& state) {
+  const char* socket_path = getenv("NOTIFY_SOCKET");
+  struct sockaddr_un addr;
+
+  if (!socket_path || (socket_path[0] != '/' && socket_path[0] != '@')) {
+    return false;
+  }
+
+  size_t path_len = strlen(socket_path);
+  if (path_len >= sizeof(addr.sun_path)) {
+    return false;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return false;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, socket_path, path_len);
+
+  // abstract namespace
+  if (addr.sun_path[0] == '@') {
+    addr.sun_path[0] = '\0';
+  }
+
+  socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + path_len;
+  bool sent = sendto(fd, state.c_str(), state.size(), MSG_NOSIGNAL, (struct sockaddr*)&addr,
+                     addr_len) == (ssize_t)state.size();
+
+  if (!sent) {
+    debug_log("cannot notify systemd: %s", strerror(errno));
+  }
+
+  close(fd);
+  return sent;
+}
+
+void sd_notify_status(const string& status) { sd_notify("STATUS=" + status); }
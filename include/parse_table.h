@@ -19,16 +19,26 @@
 using std::string;
 using std::vector;
 
-vector<coord_t> parse_table(const char* path, bool check = false) {
+/*
+ * Parse the table into `table'
+ * returns false on error instead of exiting, `table' is left untouched
+ */
+bool try_parse_table(const char* path, vector<coord_t>* table, bool check = false) {
   vector<coord_t> result;
   vector<string> lines;
 
+  if (access(path, R_OK) != 0) {
+    daemon_log(LOG_ERR, "cannot open `%s'", path);
+    sprintf_stderr("%s: cannot open `%s'", argv0, path);
+    return false;
+  }
+
   try {
     lines = read_lines(path);
   } catch (...) {
     daemon_log(LOG_ERR, "cannot parse `%s'", path);
     sprintf_stderr("%s: cannot parse `%s'", argv0, path);
-    exit(EXIT_FAILURE);
+    return false;
   }
 
 #ifdef USE_REGEX
@@ -60,14 +70,14 @@ vector<coord_t> parse_table(const char* path, bool check = false) {
       coord_t row;
 
       try {
-        row.x = std::stoi(parsed[0]);
-        row.y = std::stoi(parsed[1]);
+        row.x = std::stoi(parsed.at(0));
+        row.y = std::stoi(parsed.at(1));
 
         result.push_back(row);
       } catch (...) {
         daemon_log(LOG_ERR, "cannot parse `%s' at line %d", path, i);
         sprintf_stderr("%s: cannot parse `%s' at line %d", argv0, path, i);
-        exit(EXIT_FAILURE);
+        return false;
       }
     }
   }
@@ -78,18 +88,41 @@ vector<coord_t> parse_table(const char* path, bool check = false) {
     for (size_t i = 0; i < result.size(); i++) {
       if (result[i].y < 0 || result[i].y > 100) {
         daemon_log(LOG_ERR,
-                   "%s: parse error in `%s' at row %d:"
+                   "parse error in `%s' at row %d:"
                    "    fan speed should be >= 0 and <= 100. got %d",
                    path, i, result[i].y);
         sprintf_stderr(
             "%s: parse error in `%s' at row %d:"
             "    fan speed should be >= 0 and <= 100. got %d",
             argv0, path, i, result[i].y);
-        exit(EXIT_FAILURE);
+        return false;
+      }
+
+      if (i > 0 && result[i].x < result[i - 1].x) {
+        daemon_log(LOG_ERR,
+                   "parse error in `%s' at row %d:"
+                   "    temperatures should be in ascending order",
+                   path, i);
+        sprintf_stderr(
+            "%s: parse error in `%s' at row %d:"
+            "    temperatures should be in ascending order",
+            argv0, path, i);
+        return false;
       }
     }
   }
 
+  *table = result;
+  return true;
+}
+
+vector<coord_t> parse_table(const char* path, bool check = false) {
+  vector<coord_t> result;
+
+  if (!try_parse_table(path, &result, check)) {
+    exit(EXIT_FAILURE);
+  }
+
   return result;
 }
 
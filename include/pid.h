@@ -13,8 +13,6 @@
 #include "log.h"
 #include "utils.h"
 
-#define VARRUN "/var/run"
-
 #ifndef PATH_MAX
 #define PATH_MAX 512
 #endif
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+
+#include "defines.h"
+#include "interpolate.h"
+
+/*
+ * Holds the temperature at a setpoint.
+ * Inputs are in millidegrees, the output is the fan speed in percent.
+ */
+typedef struct {
+  // settings
+  unsigned setpoint = 60000;  // millidegrees
+  double kp = 2.0;            // percent per degree
+  double ki = 0.05;           // percent per degree second
+  double kd = 10.0;           // percent per degree per second
+  double d_filter = 5.0;      // time constant of the derivative filter, seconds
+
+  double integral = 0;    // percent
+  double derivative = 0;  // filtered degrees per second
+  double output = 0;      // percent
+
+  // previous tick
+  bool has_last = false;
+  double last_temp = 0;
+  int64_t last_time = 0;
+} pid_controller_t;
+
+void pid_reset(pid_controller_t* pid) {
+  pid->integral = 0;
+  pid->derivative = 0;
+  pid->output = 0;
+  pid->has_last = false;
+}
+
+/*
+ * One step of the controller, returns the fan speed in hundredths of a percent
+ */
+unsigned pid_update(pid_controller_t* pid, unsigned temp, int64_t time_ms) {
+  double t = temp / 1000.0;
+  double error = t - pid->setpoint / 1000.0;
+  double dt = 0;
+
+  if (pid->has_last && time_ms > pid->last_time) {
+    dt = (time_ms - pid->last_time) / 1000.0;
+
+    // derivative on the measurement, a setpoint change does not kick the output
+    double alpha = dt / (pid->d_filter + dt);
+    pid->derivative += alpha * ((t - pid->last_temp) / dt - pid->derivative);
+  }
+
+  double unclamped = pid->kp * error + pid->integral + pid->ki * error * dt +
+                     pid->kd * pid->derivative;
+
+  // anti-windup: only integrate while the output is not pushed further into saturation
+  if ((unclamped < 100 || error < 0) && (unclamped > 0 || error > 0)) {
+    pid->integral = std::clamp(pid->integral + pid->ki * error * dt, 0.0, 100.0);
+  }
+
+  pid->output = std::clamp(pid->kp * error + pid->integral + pid->kd * pid->derivative, 0.0, 100.0);
+
+  pid->has_last = true;
+  pid->last_temp = t;
+  pid->last_time = time_ms;
+
+  return unsigned(pid->output * CURVE_SPEED_SCALE + 0.5);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <algorithm>
+
+/*
+ * Simulated board and fan, a first order thermal model
+ *
+ *   capacity * dT/dt = power(load) - conductance(pwm) * (T - ambient)
+ *
+ * Temperatures in degrees, power in watts, load and pwm between 0 and 1.
+ */
+typedef struct {
+  double ambient = 25.0;
+  double idle_power = 3.0;
+  double load_power = 12.0;        // added at full load
+  double capacity = 60.0;          // joules per degree
+  double conductance = 0.15;       // watts per degree, fan stopped
+  double fan_conductance = 0.6;    // added at full fan speed
+  unsigned rpm_max = 5000;
+  double fan_start = 0.1;  // the fan does not turn below this duty
+
+  double temp = 25.0;
+  double load = 0;
+  double pwm = 0;
+} plant_t;
+
+/*
+ * Advance the simulation by `dt' seconds
+ */
+void plant_step(plant_t* plant, double dt) {
+  // small steps keep the explicit integration stable
+  while (dt > 0) {
+    double step = std::min(dt, 0.5);
+    double fan = plant->pwm >= plant->fan_start ? plant->pwm : 0;
+    double power = plant->idle_power + plant->load_power * plant->load;
+    double conductance = plant->conductance + plant->fan_conductance * fan;
+
+    plant->temp += step * (power - conductance * (plant->temp - plant->ambient)) / plant->capacity;
+    dt -= step;
+  }
+}
+
+// millidegrees, like a thermal zone
+unsigned plant_temp(const plant_t* plant) {
+  return unsigned(std::max(plant->temp, 0.0) * 1000 + 0.5);
+}
+
+int plant_rpm(const plant_t* plant) {
+  return plant->pwm >= plant->fan_start ? int(plant->pwm * plant->rpm_max) : 0;
+}
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include "defines.h"
+#include "log.h"
+
+using std::vector;
+
+#define REACTOR_MAX_EVENTS 8
+#define NSEC_PER_MSEC 1000000L
+#define NSEC_PER_SEC 1000000000L
+
+typedef std::function<void(uint32_t events)> reactor_callback_t;
+
+typedef struct {
+  int fd;
+  reactor_callback_t callback;
+} reactor_handler_t;
+
+/*
+ * A single epoll loop multiplexing every fd of the daemon
+ */
+typedef struct {
+  int epoll_fd = -1;
+  bool running = false;
+  vector<reactor_handler_t> handlers;
+} reactor_t;
+
+/*
+ * Periodic timer with absolute deadlines, the work done in a tick
+ * does not delay the next one
+ */
+typedef struct {
+  int fd = -1;
+  unsigned period = 0;  // milliseconds
+  struct timespec next;
+} tick_timer_t;
+
+void reactor_init(reactor_t* reactor) {
+  reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+  if (reactor->epoll_fd < 0) {
+    daemon_log(LOG_ERR, "cannot create epoll instance: %s", strerror(errno));
+    sprintf_stderr("%s: cannot create epoll instance: %s", argv0, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  reactor->running = true;
+}
+
+void reactor_add(reactor_t* reactor, int fd, reactor_callback_t callback,
+                 uint32_t events = EPOLLIN) {
+  struct epoll_event event;
+
+  memset(&event, 0, sizeof(event));
+  event.events = events;
+  event.data.fd = fd;
+
+  if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    daemon_log(LOG_ERR, "cannot add fd %d to epoll: %s", fd, strerror(errno));
+    sprintf_stderr("%s: cannot add fd %d to epoll: %s", argv0, fd, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  reactor->handlers.push_back({fd, callback});
+}
+
+void reactor_remove(reactor_t* reactor, int fd) {
+  epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+
+  for (auto it = reactor->handlers.begin(); it != reactor->handlers.end(); ++it) {
+    if (it->fd == fd) {
+      reactor->handlers.erase(it);
+      return;
+    }
+  }
+}
+
+// change the events `fd' is watched for
+void reactor_modify(reactor_t* reactor, int fd, uint32_t events) {
+  struct epoll_event event;
+
+  memset(&event, 0, sizeof(event));
+  event.events = events;
+  event.data.fd = fd;
+
+  if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
+    daemon_log(LOG_WARNING, "cannot modify fd %d in epoll: %s", fd, strerror(errno));
+  }
+}
+
+/*
+ * Wait for events and dispatch them to their handlers
+ */
+void reactor_run_once(reactor_t* reactor, int timeout_ms = -1) {
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+  int count = epoll_wait(reactor->epoll_fd, events, REACTOR_MAX_EVENTS, timeout_ms);
+
+  if (count < 0) {
+    if (errno == EINTR) return;
+
+    daemon_log(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+    reactor->running = false;
+    return;
+  }
+
+  for (int i = 0; i < count && reactor->running; i++) {
+    for (const auto& handler : reactor->handlers) {
+      if (handler.fd == events[i].data.fd) {
+        // copy, the callback can remove its own handler
+        reactor_callback_t callback = handler.callback;
+        callback(events[i].events);
+        break;
+      }
+    }
+  }
+}
+
+void reactor_run(reactor_t* reactor) {
+  while (reactor->running) {
+    reactor_run_once(reactor);
+  }
+}
+
+void reactor_stop(reactor_t* reactor) { reactor->running = false; }
+
+static void timespec_add_ms(struct timespec* ts, int64_t ms) {
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += (ms % 1000) * NSEC_PER_MSEC;
+
+  if (ts->tv_nsec >= NSEC_PER_SEC) {
+    ts->tv_sec++;
+    ts->tv_nsec -= NSEC_PER_SEC;
+  } else if (ts->tv_nsec < 0) {
+    ts->tv_sec--;
+    ts->tv_nsec += NSEC_PER_SEC;
+  }
+}
+
+static void timer_arm(tick_timer_t* timer) {
+  struct itimerspec spec;
+
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value = timer->next;
+  spec.it_interval.tv_sec = timer->period / 1000;
+  spec.it_interval.tv_nsec = (timer->period % 1000) * NSEC_PER_MSEC;
+
+  if (timerfd_settime(timer->fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+    daemon_log(LOG_ERR, "cannot arm timer: %s", strerror(errno));
+    sprintf_stderr("%s: cannot arm timer: %s", argv0, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Create the timer, the first tick fires immediately
+ */
+void timer_start(tick_timer_t* timer, unsigned period_ms) {
+  timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+
+  if (timer->fd < 0) {
+    daemon_log(LOG_ERR, "cannot create timer: %s", strerror(errno));
+    sprintf_stderr("%s: cannot create timer: %s", argv0, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  timer->period = std::max(period_ms, 1u);
+  clock_gettime(CLOCK_MONOTONIC, &timer->next);
+  timer_arm(timer);
+}
+
+/*
+ * Consume the expirations and move the deadline forward
+ * returns the number of periods elapsed since the last call
+ */
+uint64_t timer_expired(tick_timer_t* timer) {
+  uint64_t expirations = 0;
+
+  if (read(timer->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+    return 0;
+  }
+
+  timespec_add_ms(&timer->next, int64_t(timer->period) * expirations);
+
+  return expirations;
+}
+
+/*
+ * How late the last expiration was handled, in microseconds
+ */
+int64_t timer_lateness_us(const tick_timer_t* timer) {
+  struct timespec now;
+  struct timespec deadline = timer->next;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  timespec_add_ms(&deadline, -int64_t(timer->period));
+
+  return (int64_t(now.tv_sec) - deadline.tv_sec) * 1000000 + (now.tv_nsec - deadline.tv_nsec) / 1000;
+}
+
+/*
+ * Change the period, the next tick is one new period after the last one
+ */
+void timer_set_period(tick_timer_t* timer, unsigned period_ms) {
+  period_ms = std::max(period_ms, 1u);
+  if (period_ms == timer->period) return;
+
+  timespec_add_ms(&timer->next, int64_t(period_ms) - int64_t(timer->period));
+  timer->period = period_ms;
+  timer_arm(timer);
+}
+
+/*
+ * Timer that fires once, `ms' after oneshot_arm()
+ */
+int oneshot_create() {
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+
+  if (fd < 0) {
+    daemon_log(LOG_ERR, "cannot create timer: %s", strerror(errno));
+    sprintf_stderr("%s: cannot create timer: %s", argv0, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  return fd;
+}
+
+void oneshot_arm(int fd, unsigned ms) {
+  struct itimerspec spec;
+
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec = ms / 1000;
+  spec.it_value.tv_nsec = (ms % 1000) * NSEC_PER_MSEC;
+  // a zero it_value disarms the timer
+  if (ms == 0) spec.it_value.tv_nsec = 1;
+
+  if (timerfd_settime(fd, 0, &spec, NULL) < 0) {
+    daemon_log(LOG_ERR, "cannot arm timer: %s", strerror(errno));
+  }
+}
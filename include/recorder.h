@@ -0,0 +1,364 @@
+#pragma once
+
+/*
+ * Tick history in /var/lib/fantable
+ *
+ * Every tick is one fixed size record. Records are kept in memory and
+ * written a block at a time, so the storage sees one write every
+ * `flush' seconds instead of one per tick.
+ *
+ * File layout (native endianness, version 1):
+ *
+ *   record_header_t
+ *   char names[zone_count][RECORD_NAME_SIZE]   zone names, zero padded
+ *   blocks until the end of the file
+ *
+ * Block layout, with values = zone_count + RECORD_FIXED_VALUES:
+ *
+ *   record_block_t
+ *   int32_t base[values]                       first record of the block
+ *   record_delta_t[count]                      each one relative to the previous
+ *
+ * The values are the zones in millidegrees, then the aggregate
+ * temperature, the target pwm, cur_pwm and the rpm (-1 without tachometer).
+ * A record that does not fit in a delta starts a new block. Files rotate
+ * when they grow past `file_size' or get older than `file_age', only the
+ * newest `files' are kept. Every start of the daemon begins a new file.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "defines.h"
+#include "jetson_clocks.h"
+#include "json.h"
+#include "log.h"
+#include "utils.h"
+
+using std::string;
+using std::vector;
+
+#define RECORD_MAGIC 0x43455246        // "FREC"
+#define RECORD_BLOCK_MAGIC 0x4b4c4246  // "FBLK"
+#define RECORD_VERSION 1
+#define RECORD_NAME_SIZE 32
+// far more thermal zones than any board has, a file claiming more is corrupt
+#define RECORD_MAX_ZONES 256
+// aggregate, target pwm, cur_pwm, rpm
+#define RECORD_FIXED_VALUES 4
+#define RECORD_FILE_GLOB root_path("/var/lib/" PACKAGE_NAME "/record-*.bin")
+#define RECORD_FILE_FORMAT "/var/lib/" PACKAGE_NAME "/record-%013lld.bin"
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t zone_count;
+  uint32_t header_size;  // up to the first block
+  int64_t created;       // milliseconds since the epoch
+} record_header_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t count;     // delta records after the base
+  int64_t timestamp;  // of the base, milliseconds since the epoch
+} record_block_t;
+
+// followed by one int16_t per value
+typedef struct {
+  uint16_t dt;  // milliseconds since the previous record
+} record_delta_t;
+
+typedef struct {
+  // settings
+  unsigned flush = 600;       // seconds between writes
+  unsigned file_size = 1024;  // KiB
+  unsigned file_age = 24;     // hours
+  unsigned files = 30;
+
+  vector<string> names;
+  int fd = -1;
+  int64_t file_created = 0;
+  size_t file_bytes = 0;
+
+  vector<char> block;  // pending, not written yet
+  int64_t block_time = 0;
+  int64_t last_time = 0;
+  vector<int32_t> last;
+
+  unsigned long records = 0;
+  unsigned long writes = 0;
+} recorder_t;
+
+// flushed by the exit handler
+static recorder_t recorder;
+
+static size_t record_delta_size(size_t values) { return sizeof(record_delta_t) + 2 * values; }
+
+static void record_prune(const recorder_t* rec) {
+  vector<string> paths = glob_paths(RECORD_FILE_GLOB);
+  std::sort(paths.begin(), paths.end());
+
+  for (size_t i = 0; i + rec->files < paths.size(); i++) {
+    debug_log("removing old record `%s'", paths[i].c_str());
+    unlink(paths[i].c_str());
+  }
+}
+
+/*
+ * Start a new file named after `time'
+ */
+static bool record_rotate(recorder_t* rec, int64_t time) {
+  if (rec->fd >= 0) close(rec->fd);
+
+  string path = path_root + string_format(RECORD_FILE_FORMAT, (long long)time);
+  mkdir(STATE_DIR, 0755);
+
+  rec->fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (rec->fd < 0) {
+    daemon_log(LOG_WARNING, "cannot create `%s': %s", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  record_header_t header;
+  memset(&header, 0, sizeof(header));
+  header.magic = RECORD_MAGIC;
+  header.version = RECORD_VERSION;
+  header.zone_count = rec->names.size();
+  header.header_size = sizeof(header) + rec->names.size() * RECORD_NAME_SIZE;
+  header.created = time;
+
+  vector<char> out(header.header_size, 0);
+  memcpy(out.data(), &header, sizeof(header));
+  for (size_t i = 0; i < rec->names.size(); i++) {
+    strncpy(out.data() + sizeof(header) + i * RECORD_NAME_SIZE, rec->names[i].c_str(),
+            RECORD_NAME_SIZE - 1);
+  }
+
+  rec->file_created = time;
+  rec->file_bytes = 0;
+
+  if (write(rec->fd, out.data(), out.size()) != ssize_t(out.size())) {
+    daemon_log(LOG_WARNING, "cannot write `%s': %s", path.c_str(), strerror(errno));
+    close(rec->fd);
+    rec->fd = -1;
+    return false;
+  }
+
+  rec->file_bytes = out.size();
+  debug_log("recording to `%s'", path.c_str());
+  record_prune(rec);
+
+  return true;
+}
+
+/*
+ * Write the pending block, rotating first if the file is full or too old
+ */
+void recorder_flush(recorder_t* rec) {
+  if (rec->block.empty()) return;
+
+  bool full = rec->file_bytes + rec->block.size() > size_t(rec->file_size) * 1024;
+  bool old = rec->block_time - rec->file_created >= int64_t(rec->file_age) * 3600 * 1000;
+
+  if ((rec->fd < 0 || full || old) && !record_rotate(rec, rec->block_time)) {
+    rec->block.clear();
+    return;
+  }
+
+  if (write(rec->fd, rec->block.data(), rec->block.size()) != ssize_t(rec->block.size())) {
+    daemon_log(LOG_WARNING, "cannot write the record: %s", strerror(errno));
+  } else {
+    rec->file_bytes += rec->block.size();
+    rec->writes++;
+  }
+
+  rec->block.clear();
+}
+
+/*
+ * Record the zone names, nothing is written before the first flush
+ */
+void recorder_open(recorder_t* rec, const vector<string>& names) {
+  rec->names = names;
+  rec->block.clear();
+  rec->block.reserve(sizeof(record_block_t) + 4096);
+}
+
+void recorder_close(recorder_t* rec) {
+  recorder_flush(rec);
+
+  if (rec->fd >= 0) {
+    close(rec->fd);
+    rec->fd = -1;
+  }
+}
+
+static void record_start_block(recorder_t* rec, int64_t time, const vector<int32_t>& values) {
+  record_block_t block = {RECORD_BLOCK_MAGIC, 0, time};
+  size_t size = sizeof(block) + values.size() * sizeof(int32_t);
+
+  rec->block.resize(size);
+  memcpy(rec->block.data(), &block, sizeof(block));
+  memcpy(rec->block.data() + sizeof(block), values.data(), values.size() * sizeof(int32_t));
+  rec->block_time = time;
+}
+
+/*
+ * Add a tick, `values' as described at the top of the file
+ */
+void recorder_append(recorder_t* rec, int64_t time, const vector<int32_t>& values) {
+  bool fits = !rec->block.empty() && values.size() == rec->last.size() &&
+              time >= rec->last_time && time - rec->last_time <= UINT16_MAX;
+
+  for (size_t i = 0; fits && i < values.size(); i++) {
+    int64_t delta = int64_t(values[i]) - rec->last[i];
+    fits = delta >= INT16_MIN && delta <= INT16_MAX;
+  }
+
+  if (!fits) {
+    recorder_flush(rec);
+    record_start_block(rec, time, values);
+  } else {
+    size_t offset = rec->block.size();
+    uint16_t dt = time - rec->last_time;
+
+    rec->block.resize(offset + record_delta_size(values.size()));
+    memcpy(rec->block.data() + offset, &dt, sizeof(dt));
+
+    int16_t* deltas = (int16_t*)(rec->block.data() + offset + sizeof(record_delta_t));
+    for (size_t i = 0; i < values.size(); i++) deltas[i] = values[i] - rec->last[i];
+
+    ((record_block_t*)rec->block.data())->count++;
+  }
+
+  rec->last = values;
+  rec->last_time = time;
+  rec->records++;
+
+  if (time - rec->block_time >= int64_t(rec->flush) * 1000) {
+    recorder_flush(rec);
+  }
+}
+
+/*
+ * Recorded files, oldest first
+ */
+vector<string> record_files() {
+  vector<string> paths = glob_paths(RECORD_FILE_GLOB);
+  std::sort(paths.begin(), paths.end());
+  return paths;
+}
+
+typedef std::function<void(const vector<string>& names, int64_t time,
+                            const vector<int32_t>& values)>
+    record_callback_t;
+
+/*
+ * Call `callback' for every record of `path', a block cut short by a
+ * crash ends the file. Returns false if it is not a record file.
+ */
+bool record_read_file(const char* path, const record_callback_t& callback) {
+  std::ifstream in_stream(path, std::ios::binary);
+  record_header_t header;
+
+  if (!in_stream.read((char*)&header, sizeof(header)) || header.magic != RECORD_MAGIC ||
+      header.version != RECORD_VERSION || header.zone_count > RECORD_MAX_ZONES ||
+      header.header_size != sizeof(header) + header.zone_count * RECORD_NAME_SIZE) {
+    return false;
+  }
+
+  vector<string> names;
+  char name[RECORD_NAME_SIZE];
+  for (uint32_t i = 0; i < header.zone_count && in_stream.read(name, RECORD_NAME_SIZE); i++) {
+    name[RECORD_NAME_SIZE - 1] = '\0';
+    names.push_back(name);
+  }
+
+  if (names.size() != header.zone_count) return false;
+
+  size_t count = header.zone_count + RECORD_FIXED_VALUES;
+  vector<int32_t> values(count);
+  vector<int16_t> deltas(count);
+  in_stream.seekg(header.header_size);
+
+  record_block_t block;
+  while (in_stream.read((char*)&block, sizeof(block)) && block.magic == RECORD_BLOCK_MAGIC) {
+    if (!in_stream.read((char*)values.data(), count * sizeof(int32_t))) break;
+
+    int64_t time = block.timestamp;
+    callback(names, time, values);
+
+    for (uint32_t n = 0; n < block.count; n++) {
+      record_delta_t delta;
+
+      if (!in_stream.read((char*)&delta, sizeof(delta)) ||
+          !in_stream.read((char*)deltas.data(), count * sizeof(int16_t))) {
+        return true;
+      }
+
+      time += delta.dt;
+      for (size_t i = 0; i < count; i++) values[i] += deltas[i];
+      callback(names, time, values);
+    }
+  }
+
+  return true;
+}
+
+/*
+ * Print every recorded tick as CSV, or as a JSON array
+ */
+void dump_records(bool json) {
+  vector<string> header;
+  bool first = true;
+
+  if (json) printf("[");
+
+  for (const auto& path : record_files()) {
+    bool valid = record_read_file(path.c_str(), [&](const vector<string>& names, int64_t time,
+                                                    const vector<int32_t>& values) {
+      size_t zones = names.size();
+      const int32_t* fixed = values.data() + zones;
+
+      if (json) {
+        printf("%s\n{\"time\":%lld,\"zones\":{", first ? "" : ",", (long long)time);
+        for (size_t i = 0; i < zones; i++) {
+          printf("%s\"%s\":%d", i > 0 ? "," : "", json_string(names[i]).c_str(), values[i]);
+        }
+        printf("},\"temperature\":%d,\"target_pwm\":%d,\"cur_pwm\":%d,\"rpm\":%d}", fixed[0],
+               fixed[1], fixed[2], fixed[3]);
+      } else {
+        // the sensors can change between two runs of the daemon
+        if (first || names != header) {
+          printf("time_ms");
+          for (const auto& name : names) printf(",%s", name.c_str());
+          printf(",temperature,target_pwm,cur_pwm,rpm\n");
+          header = names;
+        }
+
+        printf("%lld", (long long)time);
+        for (size_t i = 0; i < zones; i++) printf(",%d", values[i]);
+        printf(",%d,%d,%d,%d\n", fixed[0], fixed[1], fixed[2], fixed[3]);
+      }
+
+      first = false;
+    });
+
+    if (!valid) {
+      sprintf_stderr("%s: `%s' is not a record file", argv0, path.c_str());
+    }
+  }
+
+  if (json) printf("\n]\n");
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "defines.h"
+#include "interpolate.h"
+#include "load_config.h"
+#include "log.h"
+#include "parse_table.h"
+
+#define INOTIFY_BUFFER_SIZE 4096
+
+/*
+ * Watch the config directory, editors usually replace files with a rename
+ * so watching the files themselves would lose track of them
+ * returns -1 on failure
+ */
+int watch_config() {
+  int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+
+  if (fd < 0) {
+    daemon_log(LOG_WARNING, "cannot initialize inotify: %s", strerror(errno));
+    return -1;
+  }
+
+  if (inotify_add_watch(fd, CONFIG_DIR, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+    daemon_log(LOG_WARNING, "cannot watch `%s': %s", CONFIG_DIR, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static const char* file_name(const char* path) {
+  const char* slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
+
+static bool is_config_file(const char* name) {
+  return strcmp(name, file_name(TABLE_PATH)) == 0 || strcmp(name, file_name(CONFIG_FILE_PATH)) == 0;
+}
+
+/*
+ * Drain the inotify events
+ * returns true if the table or the config changed
+ */
+bool config_changed(int fd) {
+  alignas(struct inotify_event) char buf[INOTIFY_BUFFER_SIZE];
+  bool changed = false;
+  ssize_t len;
+
+  while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    for (char* ptr = buf; ptr < buf + len;) {
+      const struct inotify_event* event = (const struct inotify_event*)ptr;
+
+      if (event->len > 0 && is_config_file(event->name)) {
+        changed = true;
+      }
+
+      ptr += sizeof(struct inotify_event) + event->len;
+    }
+  }
+
+  return changed;
+}
+
+/*
+ * Parse and validate the table and the config without touching the running state
+ * returns false if either is invalid, the outputs are only written on success
+ */
+bool load_new_config(options_t* oobj, fan_curve_t* curve) {
+  options_t new_oobj = *oobj;
+  vector<coord_t> table;
+
+  // the fan and clock settings stay as they were at startup
+  bool saved_enable_tach = enable_tach;
+  bool saved_enable_max_freq = enable_max_freq;
+  bool config_ok = load_config(&new_oobj);
+  enable_tach = saved_enable_tach;
+  enable_max_freq = saved_enable_max_freq;
+
+  if (!config_ok) {
+    daemon_log(LOG_ERR, "invalid config `%s', keeping the old one", CONFIG_FILE_PATH);
+    return false;
+  }
+
+  if (!try_parse_table(TABLE_PATH, &table, true) || table.size() < 1) {
+    daemon_log(LOG_ERR, "invalid table `%s', keeping the old one", TABLE_PATH);
+    return false;
+  }
+
+  // these need the sensors and the uevent socket to be set up again
+  if (new_oobj.substring != oobj->substring ||
+      new_oobj.include_sensors != oobj->include_sensors ||
+      new_oobj.sensor_weights != oobj->sensor_weights ||
+      new_oobj.zone_tables != oobj->zone_tables || new_oobj.event_driven != oobj->event_driven ||
+      new_oobj.feedforward != oobj->feedforward || new_oobj.mode != oobj->mode) {
+    daemon_log(LOG_WARNING,
+               "the sensor selection, event_driven, feedforward and mode are only applied on "
+               "restart");
+    new_oobj.substring = oobj->substring;
+    new_oobj.include_sensors = oobj->include_sensors;
+    new_oobj.sensor_weights = oobj->sensor_weights;
+    new_oobj.zone_tables = oobj->zone_tables;
+    new_oobj.event_driven = oobj->event_driven;
+    new_oobj.feedforward = oobj->feedforward;
+    new_oobj.mode = oobj->mode;
+  }
+
+  *curve = compile_curve(table, new_oobj.table_step);
+  *oobj = new_oobj;
+
+  return true;
+}
@@ -0,0 +1,343 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "actuator.h"
+#include "filter.h"
+#include "interpolate.h"
+#include "load.h"
+#include "load_config.h"
+#include "log.h"
+#include "mpc.h"
+#include "pid_controller.h"
+#include "plant.h"
+#include "recorder.h"
+#include "tach.h"
+#include "telemetry.h"
+
+using std::string;
+using std::vector;
+
+/*
+ * A recorded workload, temperatures in millidegrees
+ */
+typedef struct {
+  int64_t time_ms;
+  unsigned temp;
+  double load;  // 0 to 1, below 0 if unknown
+  int pwm;      // -1 if unknown
+} trace_point_t;
+
+typedef struct {
+  string name;
+  vector<trace_point_t> points;
+} trace_t;
+
+/*
+ * A table and the config it runs with
+ */
+typedef struct {
+  string name;
+  options_t options;
+  fan_curve_t curve;
+} candidate_t;
+
+typedef struct {
+  double seconds = 0;
+  double seconds_above = 0;  // at or above the threshold
+  unsigned peak = 0;         // millidegrees
+  double fan_energy = 0;     // seconds at full speed
+  unsigned long writes = 0;
+  double throttle_seconds = 0;  // fan at full speed and still above dvfs_trigger
+} replay_result_t;
+
+/*
+ * CSV with a header naming the columns: `time' (seconds) or `time_ms',
+ * `temperature' (millidegrees) and at least one of `load' (0 to 1) and `pwm'
+ */
+bool trace_load_csv(const char* path, trace_t* trace) {
+  std::ifstream in_stream(path);
+  string line;
+  int time_col = -1, time_ms_col = -1, temp_col = -1, load_col = -1, pwm_col = -1;
+
+  if (!in_stream || !std::getline(in_stream, line)) {
+    sprintf_stderr("%s: cannot read `%s'", argv0, path);
+    return false;
+  }
+
+  vector<string> header = split_string(trim(line), ",");
+  for (size_t i = 0; i < header.size(); i++) {
+    string column = trim(header[i]);
+    if (column == "time") time_col = i;
+    if (column == "time_ms") time_ms_col = i;
+    if (column == "temperature") temp_col = i;
+    if (column == "load") load_col = i;
+    if (column == "pwm") pwm_col = i;
+  }
+
+  if ((time_col < 0 && time_ms_col < 0) || temp_col < 0 || (load_col < 0 && pwm_col < 0)) {
+    sprintf_stderr("%s: `%s' needs a time, a temperature and a load or pwm column", argv0, path);
+    return false;
+  }
+
+  for (size_t row = 2; std::getline(in_stream, line); row++) {
+    if (is_only_ascii_whitespace(line) || line[0] == '#') continue;
+
+    vector<string> fields = split_string(trim(line), ",");
+    trace_point_t point;
+
+    try {
+      point.time_ms = time_ms_col >= 0 ? std::stoll(fields.at(time_ms_col))
+                                       : int64_t(std::stod(fields.at(time_col)) * 1000);
+      point.temp = std::stoul(fields.at(temp_col));
+      point.load = load_col >= 0 ? std::clamp(std::stod(fields.at(load_col)), 0.0, 1.0) : -1;
+      point.pwm = pwm_col >= 0 ? std::stoi(fields.at(pwm_col)) : -1;
+    } catch (...) {
+      sprintf_stderr("%s: cannot parse `%s' at line %zu", argv0, path, row);
+      return false;
+    }
+
+    if (!trace->points.empty() && point.time_ms <= trace->points.back().time_ms) {
+      sprintf_stderr("%s: `%s' goes back in time at line %zu", argv0, path, row);
+      return false;
+    }
+
+    trace->points.push_back(point);
+  }
+
+  return true;
+}
+
+/*
+ * A copy of the daemon's telemetry segment, the last TELEMETRY_CAPACITY ticks
+ */
+bool trace_load_telemetry(const char* path, trace_t* trace) {
+  telemetry_t tm;
+
+  if (!telemetry_attach(&tm, path)) {
+    sprintf_stderr("%s: `%s' is not a telemetry segment", argv0, path);
+    return false;
+  }
+
+  uint64_t head = telemetry_head(&tm);
+  uint64_t first = head > TELEMETRY_CAPACITY ? head - TELEMETRY_CAPACITY : 0;
+
+  for (uint64_t n = first; n < head; n++) {
+    telemetry_sample_t sample;
+    if (!telemetry_read(&tm, n, &sample)) continue;
+    if (!trace->points.empty() && sample.timestamp <= trace->points.back().time_ms) continue;
+
+    trace->points.push_back({sample.timestamp, unsigned(std::max(sample.temperature, 0)), -1,
+                             sample.pwm});
+  }
+
+  telemetry_close(&tm);
+  return true;
+}
+
+/*
+ * A history file written by the recorder
+ */
+bool trace_load_record(const char* path, trace_t* trace) {
+  return record_read_file(path, [&](const vector<string>& names, int64_t time,
+                                    const vector<int32_t>& values) {
+    if (!trace->points.empty() && time <= trace->points.back().time_ms) return;
+
+    const int32_t* fixed = values.data() + names.size();
+    trace->points.push_back({time, unsigned(std::max(fixed[0], 0)), -1, fixed[1]});
+  });
+}
+
+bool trace_load(const char* path, trace_t* trace) {
+  uint32_t magic = 0;
+  std::ifstream in_stream(path, std::ios::binary);
+
+  trace->name = path;
+  trace->points.clear();
+
+  in_stream.read((char*)&magic, sizeof(magic));
+  bool loaded = magic == TELEMETRY_MAGIC ? trace_load_telemetry(path, trace)
+                : magic == RECORD_MAGIC  ? trace_load_record(path, trace)
+                                         : trace_load_csv(path, trace);
+
+  if (loaded && trace->points.size() < 2) {
+    sprintf_stderr("%s: `%s' has less than two samples", argv0, path);
+    return false;
+  }
+
+  return loaded;
+}
+
+/*
+ * Fill the unknown loads by running the plant backwards on the recorded
+ * temperature and pwm:
+ *
+ *   power = capacity * dT/dt + conductance(pwm) * (T - ambient)
+ */
+void trace_infer_load(trace_t* trace, const plant_t& plant, unsigned pwm_cap) {
+  vector<trace_point_t>& points = trace->points;
+
+  for (size_t i = 1; i < points.size(); i++) {
+    if (points[i].load >= 0) continue;
+
+    const trace_point_t& last = points[i - 1];
+    double dt = (points[i].time_ms - last.time_ms) / 1000.0;
+    double temp = (points[i].temp + last.temp) / 2000.0;
+    double duty = std::clamp(double(std::max(last.pwm, 0)) / std::max(pwm_cap, 1u), 0.0, 1.0);
+    double fan = duty >= plant.fan_start ? duty : 0;
+
+    double power = plant.capacity * (double(points[i].temp) - last.temp) / 1000 / dt +
+                   (plant.conductance + plant.fan_conductance * fan) * (temp - plant.ambient);
+    points[i].load = std::clamp((power - plant.idle_power) / plant.load_power, 0.0, 1.0);
+  }
+
+  if (points[0].load < 0) points[0].load = points[1].load;
+}
+
+/*
+ * Run `candidate' on the plant driven by the load of `trace'. The tick
+ * mirrors the daemon's: filter, table, controller, hysteresis, rpm loop,
+ * load boost and pwm shaping, every `interval' seconds of trace time.
+ */
+replay_result_t replay_run(const candidate_t& candidate, const trace_t& trace,
+                           const plant_t& base, unsigned pwm_cap, unsigned threshold) {
+  const options_t& oobj = candidate.options;
+  replay_result_t result;
+  plant_t plant = base;
+  sensor_filter_t filter;
+
+  actuator_t actuator;
+  actuator.hysteresis = oobj.hysteresis;
+  actuator.min_delta = oobj.pwm_min_delta;
+  actuator.slew_up = oobj.pwm_slew_up;
+  actuator.slew_down = oobj.pwm_slew_down;
+  actuator.kick = oobj.spinup_kick;
+
+  tach_t tach;
+  tach.rpm_max = oobj.rpm_max;
+  tach.ki = oobj.rpm_ki;
+
+  pid_controller_t controller;
+  controller.setpoint = oobj.pid_setpoint;
+  controller.kp = oobj.pid_kp;
+  controller.ki = oobj.pid_ki;
+  controller.kd = oobj.pid_kd;
+  controller.d_filter = oobj.pid_d_filter;
+
+  mpc_t mpc;
+  mpc_reset(&mpc);
+  mpc.ceiling = oobj.mpc_ceiling;
+  mpc.horizon = oobj.mpc_horizon;
+  mpc.forgetting = oobj.mpc_forgetting;
+
+  load_t load;
+  load.cpu_weight = oobj.ff_cpu_weight;
+  load.gpu_weight = oobj.ff_gpu_weight;
+  load.psi_weight = 0;
+  load.max_boost = oobj.ff_max_boost;
+
+  const vector<trace_point_t>& points = trace.points;
+  int64_t interval_ms = std::max(oobj.interval, 1u) * 1000;
+  double dt = interval_ms / 1000.0;
+  unsigned pwm = 0;
+  size_t k = 0;
+
+  plant.temp = points[0].temp / 1000.0;
+  plant.pwm = 0;
+
+  for (int64_t t = points[0].time_ms; t <= points.back().time_ms; t += interval_ms) {
+    while (k + 1 < points.size() && points[k + 1].time_ms <= t) k++;
+
+    plant.load = points[k].load;
+    if (t > points[0].time_ms) plant_step(&plant, dt);
+
+    unsigned raw = plant_temp(&plant);
+    bool active = filter_update(oobj.filter, &filter, trace.name.c_str(), raw, t);
+    unsigned temperature = active ? filter.output : raw;
+
+    unsigned speed = curve_lookup(candidate.curve, temperature);
+    load.cpu = plant.load * 100;
+
+    if (oobj.mode == MODE_MPC) {
+      mpc_update(&mpc, temperature, load_max(&load), t);
+      if (mpc_valid(&mpc)) {
+        speed = mpc_choose(&mpc, temperature, load_max(&load));
+      }
+    } else if (oobj.mode == MODE_PID) {
+      speed = pid_update(&controller, temperature, t);
+    }
+
+    speed = actuator_hysteresis(&actuator, speed, temperature);
+
+    if (oobj.mode == MODE_RPM) {
+      speed = rpm_control(&tach, speed, plant_rpm(&plant), t);
+    }
+
+    unsigned boost = oobj.feedforward ? load_boost(&load) : 0;
+    speed = std::min(speed + boost, 100u * CURVE_SPEED_SCALE);
+
+    unsigned target_pwm = speed * pwm_cap / (100 * CURVE_SPEED_SCALE);
+    if (actuator_shape(&actuator, target_pwm, pwm_cap, t, &pwm)) {
+      result.writes++;
+    }
+
+    plant.pwm = double(pwm) / pwm_cap;
+    if (oobj.mode == MODE_MPC) {
+      mpc_applied(&mpc, pwm * 100.0 / pwm_cap);
+    }
+
+    result.seconds += dt;
+    result.peak = std::max(result.peak, raw);
+    result.fan_energy += plant.pwm * dt;
+    if (raw >= threshold) result.seconds_above += dt;
+    if (raw >= oobj.dvfs_trigger && pwm >= pwm_cap) result.throttle_seconds += dt;
+  }
+
+  return result;
+}
+
+/*
+ * Every candidate on every trace, `jobs' threads at a time.
+ * Results are summed over the traces, one per candidate.
+ */
+vector<replay_result_t> replay_all(const vector<candidate_t>& candidates,
+                                   const vector<trace_t>& traces, const plant_t& plant,
+                                   unsigned pwm_cap, unsigned threshold, unsigned jobs) {
+  size_t count = candidates.size() * traces.size();
+  vector<replay_result_t> runs(count);
+  std::atomic<size_t> next(0);
+
+  auto worker = [&]() {
+    for (size_t i; (i = next.fetch_add(1)) < count;) {
+      runs[i] = replay_run(candidates[i / traces.size()], traces[i % traces.size()], plant,
+                           pwm_cap, threshold);
+    }
+  };
+
+  vector<std::thread> threads;
+  for (unsigned i = 1; i < std::min<size_t>(jobs, count); i++) threads.emplace_back(worker);
+  worker();
+  for (auto& thread : threads) thread.join();
+
+  vector<replay_result_t> results(candidates.size());
+  for (size_t i = 0; i < count; i++) {
+    replay_result_t& total = results[i / traces.size()];
+
+    total.seconds += runs[i].seconds;
+    total.seconds_above += runs[i].seconds_above;
+    total.peak = std::max(total.peak, runs[i].peak);
+    total.fan_energy += runs[i].fan_energy;
+    total.writes += runs[i].writes;
+    total.throttle_seconds += runs[i].throttle_seconds;
+  }
+
+  return results;
+}
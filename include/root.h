@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+
+/*
+ * Every sysfs, procfs, configuration and runtime path goes through
+ * root_path, so the daemon can run against a fake tree (--root)
+ */
+static std::string path_root;
+static std::unordered_map<std::string, std::string> rooted_paths;
+
+void set_path_root(const std::string& root) {
+  path_root = root;
+
+  while (path_root.size() > 1 && path_root.back() == '/') {
+    path_root.pop_back();
+  }
+
+  if (path_root == "/") path_root.clear();
+  rooted_paths.clear();
+}
+
+/*
+ * `path' under the root, the result stays valid until the root changes
+ */
+const char* root_path(const char* path) {
+  if (path_root.empty()) return path;
+
+  auto found = rooted_paths.find(path);
+  if (found == rooted_paths.end()) {
+    found = rooted_paths.emplace(path, path_root + path).first;
+  }
+
+  return found->second.c_str();
+}
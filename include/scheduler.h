@@ -0,0 +1,119 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "defines.h"
+#include "interpolate.h"
+#include "log.h"
+#include "utils.h"
+
+/*
+ * Number of samples used to estimate the temperature slope
+ */
+#define SLOPE_SAMPLES 5
+
+typedef struct {
+  // limits in milliseconds
+  unsigned min_interval = 100;
+  unsigned max_interval = 10000;
+  // millidegrees per second
+  unsigned slope_high = 500;
+  unsigned slope_low = 50;
+  // percent of fan speed per degree
+  unsigned steep_segment = 5;
+
+  unsigned interval = 2000;
+
+  int temps[SLOPE_SAMPLES];
+  int64_t times[SLOPE_SAMPLES];
+  size_t head = 0;
+  size_t count = 0;
+} scheduler_t;
+
+void scheduler_add_sample(scheduler_t* sched, int temp, int64_t time_ms) {
+  sched->temps[sched->head] = temp;
+  sched->times[sched->head] = time_ms;
+  sched->head = (sched->head + 1) % SLOPE_SAMPLES;
+  sched->count = std::min(sched->count + 1, size_t(SLOPE_SAMPLES));
+}
+
+/*
+ * Least squares estimate of dT/dt over the recent samples in millidegrees per second
+ */
+double scheduler_slope(const scheduler_t* sched) {
+  if (sched->count < 2) return 0;
+
+  size_t first = (sched->head + SLOPE_SAMPLES - sched->count) % SLOPE_SAMPLES;
+  int64_t t0 = sched->times[first];
+  double mean_t = 0;
+  double mean_y = 0;
+
+  for (size_t i = 0; i < sched->count; i++) {
+    size_t k = (first + i) % SLOPE_SAMPLES;
+    mean_t += (sched->times[k] - t0) / 1000.0;
+    mean_y += sched->temps[k];
+  }
+
+  mean_t /= sched->count;
+  mean_y /= sched->count;
+
+  double num = 0;
+  double den = 0;
+
+  for (size_t i = 0; i < sched->count; i++) {
+    size_t k = (first + i) % SLOPE_SAMPLES;
+    double dt = (sched->times[k] - t0) / 1000.0 - mean_t;
+
+    num += dt * (sched->temps[k] - mean_y);
+    den += dt * dt;
+  }
+
+  return den > 0 ? num / den : 0;
+}
+
+/*
+ * Slope of the compiled curve at a temperature, in percent per degree
+ */
+double curve_slope(const fan_curve_t& curve, unsigned temp) {
+  size_t index = curve_index(curve, temp);
+  size_t next = std::min(index + 1, curve.speed.size() - 1);
+
+  if (next == index) return 0;
+
+  double diff = std::abs(int(curve.speed[next]) - int(curve.speed[index]));
+  return diff / CURVE_SPEED_SCALE * 1000.0 / curve.step;
+}
+
+/*
+ * Pick the next interval:
+ *  - fast rising temperature jumps straight to the minimum
+ *  - a steep segment of the curve halves the interval
+ *  - flat temperature grows the interval towards the maximum
+ */
+unsigned scheduler_update(scheduler_t* sched, const fan_curve_t& curve, unsigned temp) {
+  scheduler_add_sample(sched, temp, now_ms());
+
+  double slope = scheduler_slope(sched);
+  unsigned interval = sched->interval;
+
+  if (slope >= sched->slope_high) {
+    interval = sched->min_interval;
+  } else if (curve_slope(curve, temp) >= sched->steep_segment) {
+    interval /= 2;
+  } else if (std::abs(slope) <= sched->slope_low) {
+    interval += interval / 4 + 1;
+  }
+
+  interval = std::clamp(interval, sched->min_interval, sched->max_interval);
+
+  if (interval != sched->interval) {
+    debug_log("slope: %.1f mC/s, interval: %u ms", slope, interval);
+  }
+
+  sched->interval = interval;
+  return interval;
+}
+
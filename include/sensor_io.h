@@ -0,0 +1,184 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <string>
+
+#include "defines.h"
+#include "log.h"
+#include "utils.h"
+
+using std::string;
+
+/*
+ * An ifstream based read costs open + read + close,
+ * a persistent fd only needs the pread
+ */
+#define SENSOR_SYSCALLS_SAVED_PER_READ 2
+#define SENSOR_READ_BUFFER_SIZE 32
+
+typedef struct {
+  string path;
+  int fd = -1;
+  int value = 0;  // last value read
+} sensor_t;
+
+static unsigned long sensor_reads = 0;
+static unsigned long sensor_reopens = 0;
+static unsigned long sensor_syscalls_saved = 0;
+
+/*
+ * Parse a (possibly negative) decimal integer terminated by whitespace or NUL
+ * returns false if no digits are found or if garbage follows the number
+ */
+bool parse_int(const char* buf, int* out) {
+  const char* p = buf;
+  bool negative = false;
+  long value = 0;
+
+  while (*p == ' ' || *p == '\t') p++;
+
+  if (*p == '-' || *p == '+') {
+    negative = *p == '-';
+    p++;
+  }
+
+  if (*p < '0' || *p > '9') return false;
+
+  while (*p >= '0' && *p <= '9') {
+    value = value * 10 + (*p - '0');
+    if (value > INT_MAX) return false;
+    p++;
+  }
+
+  if (*p != '\0' && *p != '\n' && *p != '\r' && *p != ' ' && *p != '\t') return false;
+
+  *out = negative ? -value : value;
+  return true;
+}
+
+/*
+ * Open the sensor file, keeping the fd for the whole lifetime of the daemon
+ */
+bool sensor_open(sensor_t* sensor) {
+  if (sensor->fd >= 0) {
+    close(sensor->fd);
+  }
+
+  sensor->fd = open(sensor->path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (sensor->fd < 0) {
+    debug_log("cannot open sensor `%s': %s", sensor->path.c_str(), strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+void sensor_close(sensor_t* sensor) {
+  if (sensor->fd >= 0) {
+    close(sensor->fd);
+    sensor->fd = -1;
+  }
+}
+
+/*
+ * Read the beginning of the file into `buf' (NUL terminated) without reopening it
+ * returns the number of bytes read, <= 0 on failure
+ */
+ssize_t sensor_pread_text(const sensor_t* sensor, char* buf, size_t size) {
+  ssize_t len;
+
+  if (sensor->fd < 0) return -1;
+
+  do {
+    len = pread(sensor->fd, buf, size - 1, 0);
+  } while (len < 0 && errno == EINTR);
+
+  if (len < 0) return len;
+
+  buf[len] = '\0';
+  return len;
+}
+
+/*
+ * Read the beginning of a text file, reopening the fd only if the read fails
+ * returns the number of bytes read, <= 0 on failure
+ */
+ssize_t sensor_read_text(sensor_t* sensor, char* buf, size_t size) {
+  ssize_t len = sensor_pread_text(sensor, buf, size);
+
+  sensor_reads++;
+
+  if (len > 0) {
+    sensor_syscalls_saved += SENSOR_SYSCALLS_SAVED_PER_READ;
+    return len;
+  }
+
+  sensor_reopens++;
+
+  if (sensor_open(sensor)) {
+    return sensor_pread_text(sensor, buf, size);
+  }
+
+  return -1;
+}
+
+/*
+ * Read the value without reopening the file
+ * returns false if the read or the parse fails
+ */
+static bool sensor_pread(const sensor_t* sensor, int* value) {
+  char buf[SENSOR_READ_BUFFER_SIZE];
+
+  if (sensor_pread_text(sensor, buf, sizeof(buf)) <= 0) return false;
+
+  return parse_int(buf, value);
+}
+
+/*
+ * Read an int from a sensor, reopening the fd only if the read fails
+ * returns false if the sensor cannot be read
+ */
+bool sensor_try_read_int(sensor_t* sensor, int* value) {
+  sensor_reads++;
+
+  if (sensor_pread(sensor, value)) {
+    sensor_syscalls_saved += SENSOR_SYSCALLS_SAVED_PER_READ;
+    sensor->value = *value;
+    return true;
+  }
+
+  debug_log("read from `%s' failed, reopening", sensor->path.c_str());
+  sensor_reopens++;
+
+  if (sensor_open(sensor) && sensor_pread(sensor, value)) {
+    sensor->value = *value;
+    return true;
+  }
+
+  return false;
+}
+
+/*
+ * Read an int from a sensor, exits if the sensor cannot be read
+ */
+int sensor_read_int(sensor_t* sensor) {
+  int value;
+
+  if (sensor_try_read_int(sensor, &value)) {
+    return value;
+  }
+
+  daemon_log(LOG_ERR, "cannot read int from sensor `%s'", sensor->path.c_str());
+  sprintf_stderr("%s: cannot read int from sensor `%s'", argv0, sensor->path.c_str());
+  exit(EXIT_FAILURE);
+}
+
+void log_sensor_stats() {
+  daemon_log(LOG_INFO, "sensor reads: %lu, reopens: %lu, syscalls saved: %lu", sensor_reads,
+             sensor_reopens, sensor_syscalls_saved);
+}
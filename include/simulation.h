@@ -0,0 +1,85 @@
+#pragma once
+
+#include <vendor/inih/cpp/INIReader.h>
+
+#include <string>
+#include <vector>
+
+#include "defines.h"
+#include "log.h"
+#include "plant.h"
+#include "sensor_io.h"
+#include "utils.h"
+
+using std::string;
+using std::vector;
+
+/*
+ * Scripted plant for a fake root: every step reads the pwm written by the
+ * daemon and writes the zone temperatures, cur_pwm and the measured rpm.
+ * Each zone keeps the offset it had from the first zone in the fixture.
+ */
+typedef struct {
+  plant_t plant;
+  unsigned pwm_cap = 255;
+  vector<string> zone_paths;
+  vector<int> zone_offsets;  // millidegrees
+} sim_plant_t;
+
+/*
+ * Read the plant parameters from `path', missing keys keep the defaults
+ */
+void plant_read(plant_t* plant, const char* path) {
+  INIReader reader(path);
+
+  if (reader.ParseError() != 0) {
+    debug_log("no plant parameters at `%s', using the defaults", path);
+  }
+
+  plant->ambient = reader.GetReal("", "ambient", plant->ambient);
+  plant->idle_power = reader.GetReal("", "idle_power", plant->idle_power);
+  plant->load_power = reader.GetReal("", "load_power", plant->load_power);
+  plant->capacity = reader.GetReal("", "capacity", plant->capacity);
+  plant->conductance = reader.GetReal("", "conductance", plant->conductance);
+  plant->fan_conductance = reader.GetReal("", "fan_conductance", plant->fan_conductance);
+  plant->rpm_max = reader.GetInteger("", "rpm_max", plant->rpm_max);
+  plant->fan_start = reader.GetReal("", "fan_start", plant->fan_start);
+  plant->load = reader.GetReal("", "load", 0.5);
+}
+
+/*
+ * Start the plant from the fixture temperatures, parameters from PLANT_PATH
+ */
+void sim_plant_open(sim_plant_t* sim, const vector<sensor_t>& sensors, unsigned pwm_cap) {
+  plant_t& plant = sim->plant;
+  plant_read(&plant, PLANT_PATH);
+
+  sim->pwm_cap = std::max(pwm_cap, 1u);
+  sim->zone_paths.clear();
+  sim->zone_offsets.clear();
+
+  for (const auto& sensor : sensors) {
+    sim->zone_paths.push_back(sensor.path);
+    sim->zone_offsets.push_back(sensor.value - sensors[0].value);
+  }
+
+  plant.temp = sensors.empty() ? plant.ambient : sensors[0].value / 1000.0;
+}
+
+/*
+ * Advance the plant by `dt' seconds with the pwm currently written
+ */
+void sim_plant_step(sim_plant_t* sim, double dt) {
+  int pwm = read_file_int(TARGET_PWM_PATH);
+
+  sim->plant.pwm = std::clamp(double(pwm) / sim->pwm_cap, 0.0, 1.0);
+  plant_step(&sim->plant, dt);
+
+  int temp = int(plant_temp(&sim->plant));
+  for (size_t i = 0; i < sim->zone_paths.size(); i++) {
+    write_file_int(sim->zone_paths[i].c_str(), temp + sim->zone_offsets[i]);
+  }
+
+  write_file_int(CUR_PWM_PATH, pwm);
+  write_file_int(MEASURED_RPM_PATH, plant_rpm(&sim->plant));
+}
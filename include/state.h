@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "histogram.h"
+#include "sensor_io.h"
+#include "thermal.h"
+
+using std::vector;
+
+/*
+ * Where the time of a tick goes, in microseconds
+ */
+typedef struct {
+  histogram_t wakeup;  // timer deadline to the start of the tick
+  vector<histogram_t> sensor_read;  // one per sensor, allocated at startup
+  histogram_t aggregate;
+  histogram_t pwm_write;
+  histogram_t tick;
+  int64_t since = 0;  // ms, start or last reset
+} latency_t;
+
+void latency_reset(latency_t* latency) {
+  histogram_reset(&latency->wakeup);
+  for (auto& h : latency->sensor_read) histogram_reset(&h);
+  histogram_reset(&latency->aggregate);
+  histogram_reset(&latency->pwm_write);
+  histogram_reset(&latency->tick);
+  latency->since = now_ms();
+}
+
+/*
+ * Snapshot of the daemon, updated every tick and served by the control socket
+ */
+typedef struct {
+  int64_t start_time = 0;  // ms
+  int64_t last_tick = 0;   // ms
+  unsigned long ticks = 0;
+  unsigned tick_duration = 0;  // us
+  unsigned interval = 0;       // ms
+
+  unsigned temperature = 0;  // millidegrees
+  unsigned speed = 0;        // hundredths of a percent
+  unsigned boost = 0;        // load feed-forward, hundredths of a percent
+  unsigned throttle_offset = 0;  // millidegrees
+  unsigned long throttle_events = 0;
+  unsigned long throttled_ticks = 0;
+
+  const char* mode = "table";
+  bool mpc_active = false;
+  unsigned long mpc_samples = 0;
+  double mpc_time_constant = 0;  // seconds
+  double mpc_gain = 0;           // degrees per percent of fan speed
+  unsigned pid_setpoint = 0;     // millidegrees
+  double pid_integral = 0;       // percent
+
+  unsigned target_pwm = 0;
+  unsigned requested_pwm = 0;  // before shaping
+  unsigned long pwm_writes = 0;
+  unsigned long pwm_writes_avoided = 0;
+  int cur_pwm = -1;
+  int rpm = -1;  // -1 if the tachometer is disabled
+  int rpm_target = -1;  // -1 unless the mode is rpm
+  bool fan_stalled = false;
+  unsigned long fan_stalls = 0;
+
+  unsigned dvfs_level = 0;  // clock steps below the maximum
+  unsigned dvfs_max_level = 0;
+  unsigned long dvfs_steps = 0;
+
+  const vector<sensor_t>* sensors = nullptr;
+  const zone_set_t* zones = nullptr;
+  latency_t* latency = nullptr;  // reset from the control socket
+} daemon_state_t;
+
+static daemon_state_t daemon_state;
@@ -1,8 +1,10 @@
 #pragma once
 
+#include "control.h"
 #include "defines.h"
 #include "log.h"
-#include "thermal.h"
+#include "pid.h"
+#include "telemetry.h"
 
 void check_pid() {
   pid_t pid;
@@ -13,35 +15,98 @@ void check_pid() {
   }
 }
 
-void print_status(const char* ingore_substr, bool use_highest) {
+/*
+ * Print the snapshot served by the daemon on the control socket,
+ * or its answer to another `request'
+ */
+void print_status(bool json, const char* request = nullptr) {
   pid_t pid;
   int retval = ESRCH;
+  string response;
 
-  if ((pid = pid_file_is_running()) >= 0) {
-    printf("process pid: %d\n", pid);
-
-    vector<string> sensor_paths = scan_sensors(ingore_substr);
-    unsigned temperature = 0;
-    unsigned fan_pwm = 0;
-    unsigned cur_rpm = 0;
-
-    temperature = thermal_average(sensor_paths, use_highest);
-    fan_pwm = read_file_int(CUR_PWM_PATH);
-
-    printf("temperature: %d C\n", temperature / 1000);
-    printf("current pwm: %d\n", fan_pwm);
+  if (!request) request = json ? "json" : "status";
 
-    if (read_file_int(TACH_ENABLE_PATH) == 1) {
-      cur_rpm = read_file_int(MEASURED_RPM_PATH);
-      printf("current rpm: %d\n", cur_rpm);
+  if ((pid = pid_file_is_running()) >= 0) {
+    if (control_request(CONTROL_SOCKET_PATH, request, &response)) {
+      std::cout << response << std::flush;
+      retval = EXIT_SUCCESS;
     } else {
-      printf("tachometer is disabled\n");
+      sprintf_stderr("%s: cannot connect to `%s'", argv0, CONTROL_SOCKET_PATH);
+      retval = ECONNREFUSED;
     }
-
-    retval = EXIT_SUCCESS;
   } else {
     sprintf_stderr("%s is not running", argv0);
   }
 
   exit(retval);
 }
+
+/*
+ * Have the daemon write its trace, then print the file
+ */
+void print_trace() {
+  string response;
+
+  if (pid_file_is_running() < 0) {
+    sprintf_stderr("%s is not running", argv0);
+    exit(ESRCH);
+  }
+
+  if (!control_request(CONTROL_SOCKET_PATH, "trace", &response)) {
+    sprintf_stderr("%s: cannot connect to `%s'", argv0, CONTROL_SOCKET_PATH);
+    exit(ECONNREFUSED);
+  }
+
+  response = trim(response);
+  if (response != TRACE_PATH) {
+    sprintf_stderr("%s: %s", argv0, response.c_str());
+    exit(EXIT_FAILURE);
+  }
+
+  std::cout << read_file(TRACE_PATH) << std::flush;
+  exit(EXIT_SUCCESS);
+}
+
+/*
+ * Follow the telemetry ring of the daemon, printing every new sample
+ */
+void watch_status() {
+  telemetry_t tm;
+
+  if (!telemetry_attach(&tm)) {
+    sprintf_stderr("%s: cannot open `%s', is the daemon running?", argv0, TELEMETRY_PATH);
+    exit(ESRCH);
+  }
+
+  uint64_t next = telemetry_head(&tm);
+  if (next > 0) next--;
+
+  while (true) {
+    uint64_t head = telemetry_head(&tm);
+
+    // skip what was overwritten while we were sleeping
+    if (head - next > TELEMETRY_CAPACITY) {
+      next = head - TELEMETRY_CAPACITY;
+    }
+
+    for (; next < head; next++) {
+      telemetry_sample_t sample;
+      if (!telemetry_read(&tm, next, &sample)) continue;
+
+      time_t seconds = sample.timestamp / 1000;
+      char time_str[16];
+      strftime(time_str, sizeof(time_str), "%H:%M:%S", localtime(&seconds));
+
+      printf("%s  %6.2f C  pwm %3d", time_str, sample.temperature / 1000.0, sample.pwm);
+      if (sample.rpm >= 0) printf("  rpm %5d", sample.rpm);
+      printf("  |");
+      for (unsigned i = 0; i < tm.header->zone_count; i++) {
+        printf(" %6.2f", sample.zones[i] / 1000.0);
+      }
+      printf("\n");
+    }
+
+    fflush(stdout);
+    usleep(100000);
+  }
+}
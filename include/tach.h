@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+
+#include "defines.h"
+#include "interpolate.h"
+#include "log.h"
+
+/*
+ * Closed loop on the tachometer and stall detection
+ */
+typedef struct {
+  // settings
+  unsigned rpm_max = 5000;   // rpm at 100% of the table
+  double ki = 0.01;          // percent of pwm per rpm second
+  unsigned stall_rpm = 100;  // below this the fan is not spinning
+  unsigned stall_ticks = 5;
+
+  double correction = 0;  // percent of pwm
+  bool has_last = false;
+  int64_t last_time = 0;
+  unsigned target = 0;  // rpm
+
+  unsigned stall_count = 0;
+  bool stalled = false;
+  unsigned long stalls = 0;
+} tach_t;
+
+/*
+ * Turn a table speed (hundredths of a percent of rpm_max) into a pwm speed,
+ * correcting the open loop guess with the measured `rpm'
+ */
+unsigned rpm_control(tach_t* tach, unsigned speed, int rpm, int64_t time_ms) {
+  double dt = tach->has_last && time_ms > tach->last_time ? (time_ms - tach->last_time) / 1000.0 : 0;
+
+  tach->target = uint64_t(speed) * tach->rpm_max / (100 * CURVE_SPEED_SCALE);
+  tach->has_last = true;
+  tach->last_time = time_ms;
+
+  // fan off, nothing to correct
+  if (tach->target == 0) {
+    tach->correction = 0;
+    return 0;
+  }
+
+  double guess = double(speed) / CURVE_SPEED_SCALE;
+  double output = guess + tach->correction;
+
+  // no feedback from a stalled fan or a failed read, do not wind up
+  if (rpm >= 0 && !tach->stalled) {
+    double error = double(tach->target) - rpm;
+    if ((output < 100 || error < 0) && (output > 0 || error > 0)) {
+      tach->correction = std::clamp(tach->correction + tach->ki * error * dt, -100.0, 100.0);
+    }
+  }
+
+  output = std::clamp(guess + tach->correction, 0.0, 100.0);
+  return unsigned(output * CURVE_SPEED_SCALE + 0.5);
+}
+
+/*
+ * A fan driven with a pwm above 0 but not spinning for `stall_ticks' ticks is stalled
+ * returns true when the stall state changed
+ */
+bool stall_update(tach_t* tach, unsigned pwm, int rpm) {
+  if (rpm < 0) return false;
+
+  bool spinning = pwm == 0 || unsigned(rpm) >= tach->stall_rpm;
+
+  if (spinning) {
+    tach->stall_count = 0;
+
+    if (tach->stalled) {
+      daemon_log(LOG_INFO, "fan is spinning again, %d rpm", rpm);
+      tach->stalled = false;
+      return true;
+    }
+
+    return false;
+  }
+
+  if (++tach->stall_count < tach->stall_ticks || tach->stalled) {
+    return false;
+  }
+
+  daemon_log(LOG_ERR, "fan stalled or missing: pwm %u, %d rpm for %u ticks", pwm, rpm,
+             tach->stall_count);
+  tach->stalled = true;
+  tach->stalls++;
+
+  return true;
+}
@@ -0,0 +1,259 @@
+#pragma once
+
+/*
+ * Shared memory telemetry ring
+ *
+ * The daemon publishes every tick into `TELEMETRY_PATH'. Readers mmap the file
+ * read-only and never make a syscall to get new samples.
+ *
+ * Layout (native endianness, version 1):
+ *
+ *   telemetry_header_t                     header_size bytes
+ *   telemetry_slot_t[capacity]             sample_size bytes each
+ *
+ * Sample n (0 based, counting from the start of the daemon) lives in
+ * slot n % capacity. `head' is the number of samples published so far.
+ *
+ * Every slot is protected by a sequence lock:
+ *   the writer sets `seq' to an odd value, writes the sample, moves `head',
+ *   then sets `seq' to the next even value. A reader copies the sample
+ *   between two loads of `seq' and retries (or skips the slot) if they
+ *   differ or are odd. A reader that sees the new head cannot see the
+ *   previous lap of its slot as complete.
+ * The writer never waits for readers.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include "defines.h"
+#include "log.h"
+#include "sensor_io.h"
+#include "utils.h"
+
+using std::vector;
+
+#define TELEMETRY_PATH root_path("/dev/shm/" PACKAGE_NAME ".telemetry")
+#define TELEMETRY_MAGIC 0x4d4c5446  // "FTLM"
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_CAPACITY 1024
+#define TELEMETRY_MAX_ZONES 16
+#define TELEMETRY_READ_RETRIES 4
+
+typedef struct {
+  int64_t timestamp;                      // CLOCK_REALTIME, milliseconds
+  int32_t zones[TELEMETRY_MAX_ZONES];     // millidegrees, in sensor order
+  int32_t temperature;                    // aggregate, millidegrees
+  int32_t pwm;                            // target pwm
+  int32_t rpm;                            // -1 if the tachometer is disabled
+  int32_t reserved;
+} telemetry_sample_t;
+
+typedef struct {
+  uint32_t seq;
+  uint32_t reserved;
+  telemetry_sample_t sample;
+} telemetry_slot_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t sample_size;  // size of a slot
+  uint32_t capacity;
+  uint32_t zone_count;
+  uint64_t head;
+} telemetry_header_t;
+
+typedef struct {
+  int fd = -1;
+  size_t size = 0;
+  telemetry_header_t* header = nullptr;
+  telemetry_slot_t* slots = nullptr;
+} telemetry_t;
+
+static inline size_t telemetry_size() {
+  return sizeof(telemetry_header_t) + sizeof(telemetry_slot_t) * TELEMETRY_CAPACITY;
+}
+
+/*
+ * Create the segment, returns false on failure
+ *
+ * /dev/shm is world writable: a stale file is removed first and the new
+ * one must not exist, so a file or symlink planted there is never opened
+ */
+bool telemetry_create(telemetry_t* tm, unsigned zone_count) {
+  tm->size = telemetry_size();
+
+  unlink(TELEMETRY_PATH);
+  tm->fd = open(TELEMETRY_PATH, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+
+  if (tm->fd < 0) {
+    daemon_log(LOG_WARNING, "cannot create `%s': %s", TELEMETRY_PATH, strerror(errno));
+    return false;
+  }
+
+  // readable by everyone whatever the umask
+  fchmod(tm->fd, 0644);
+
+  if (ftruncate(tm->fd, tm->size) < 0) {
+    daemon_log(LOG_WARNING, "cannot resize `%s': %s", TELEMETRY_PATH, strerror(errno));
+    close(tm->fd);
+    tm->fd = -1;
+    return false;
+  }
+
+  void* mem = mmap(NULL, tm->size, PROT_READ | PROT_WRITE, MAP_SHARED, tm->fd, 0);
+  if (mem == MAP_FAILED) {
+    daemon_log(LOG_WARNING, "cannot map `%s': %s", TELEMETRY_PATH, strerror(errno));
+    close(tm->fd);
+    tm->fd = -1;
+    return false;
+  }
+
+  tm->header = (telemetry_header_t*)mem;
+  tm->slots = (telemetry_slot_t*)((char*)mem + sizeof(telemetry_header_t));
+
+  tm->header->header_size = sizeof(telemetry_header_t);
+  tm->header->sample_size = sizeof(telemetry_slot_t);
+  tm->header->capacity = TELEMETRY_CAPACITY;
+  tm->header->zone_count = std::min(zone_count, unsigned(TELEMETRY_MAX_ZONES));
+  tm->header->version = TELEMETRY_VERSION;
+  tm->header->head = 0;
+
+  // readers check the magic last
+  __atomic_store_n(&tm->header->magic, TELEMETRY_MAGIC, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+/*
+ * Map an existing segment (or a copy of one) read-only,
+ * returns false if missing or incompatible
+ */
+bool telemetry_attach(telemetry_t* tm, const char* path = TELEMETRY_PATH) {
+  tm->fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (tm->fd < 0) return false;
+
+  tm->size = telemetry_size();
+  void* mem = mmap(NULL, tm->size, PROT_READ, MAP_SHARED, tm->fd, 0);
+  if (mem == MAP_FAILED) {
+    close(tm->fd);
+    tm->fd = -1;
+    return false;
+  }
+
+  tm->header = (telemetry_header_t*)mem;
+  tm->slots = (telemetry_slot_t*)((char*)mem + sizeof(telemetry_header_t));
+
+  if (__atomic_load_n(&tm->header->magic, __ATOMIC_ACQUIRE) != TELEMETRY_MAGIC ||
+      tm->header->version != TELEMETRY_VERSION ||
+      tm->header->sample_size != sizeof(telemetry_slot_t) ||
+      tm->header->capacity != TELEMETRY_CAPACITY) {
+    munmap(mem, tm->size);
+    close(tm->fd);
+    tm->fd = -1;
+    tm->header = nullptr;
+    return false;
+  }
+
+  return true;
+}
+
+void telemetry_close(telemetry_t* tm, bool remove = false) {
+  if (tm->header) {
+    munmap(tm->header, tm->size);
+    tm->header = nullptr;
+    tm->slots = nullptr;
+  }
+
+  if (tm->fd >= 0) {
+    close(tm->fd);
+    tm->fd = -1;
+  }
+
+  if (remove) {
+    unlink(TELEMETRY_PATH);
+  }
+}
+
+/*
+ * Publish a sample, never blocks
+ */
+void telemetry_publish(telemetry_t* tm, const telemetry_sample_t& sample) {
+  if (!tm->header) return;
+
+  uint64_t head = tm->header->head;
+  telemetry_slot_t* slot = &tm->slots[head % TELEMETRY_CAPACITY];
+  uint32_t seq = slot->seq;
+
+  __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  slot->sample = sample;
+  __atomic_store_n(&tm->header->head, head + 1, __ATOMIC_RELEASE);
+
+  __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Number of samples published so far
+ */
+uint64_t telemetry_head(const telemetry_t* tm) {
+  return __atomic_load_n(&tm->header->head, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Copy sample `n' into `out'
+ * returns false if it was overwritten or is being written
+ */
+bool telemetry_read(const telemetry_t* tm, uint64_t n, telemetry_sample_t* out) {
+  const telemetry_slot_t* slot = &tm->slots[n % TELEMETRY_CAPACITY];
+
+  for (int i = 0; i < TELEMETRY_READ_RETRIES; i++) {
+    uint32_t seq1 = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq1 & 1) continue;
+
+    *out = slot->sample;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint32_t seq2 = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+
+    if (seq1 == seq2) {
+      // the slot may already hold a newer lap of the ring
+      return telemetry_head(tm) - n <= TELEMETRY_CAPACITY;
+    }
+  }
+
+  return false;
+}
+
+/*
+ * Build a sample from the current readings
+ */
+telemetry_sample_t telemetry_sample(const vector<sensor_t>& sensors, unsigned temperature,
+                                    unsigned pwm, int rpm) {
+  telemetry_sample_t sample;
+
+  memset(&sample, 0, sizeof(sample));
+
+  // a simulation stamps its own time, so the samples can be replayed
+  sample.timestamp = wall_ms();
+  for (size_t i = 0; i < sensors.size() && i < TELEMETRY_MAX_ZONES; i++) {
+    sample.zones[i] = sensors[i].value;
+  }
+  sample.temperature = temperature;
+  sample.pwm = pwm;
+  sample.rpm = rpm;
+
+  return sample;
+}
@@ -1,17 +1,82 @@
 #pragma once
 
+#include <errno.h>
 #include <glob.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <utility>
 
 #include "defines.h"
+#include "filter.h"
+#include "histogram.h"
+#include "interpolate.h"
 #include "log.h"
+#include "parse_table.h"
+#include "sensor_io.h"
 #include "utils.h"
 
+using std::pair;
 using std::string;
 using std::vector;
 
-vector<string> scan_sensors(const char* ignore_substring) {
+// a zone without a curve
+#define ZONE_NO_CURVE -1
+
+/*
+ * Split a comma separated list of patterns, empty items are dropped
+ */
+vector<string> parse_patterns(const string& list) {
+  vector<string> patterns;
+
+  for (auto item : split_string(list, ",")) {
+    item = trim(item);
+    if (!item.empty()) patterns.push_back(item);
+  }
+
+  return patterns;
+}
+
+/*
+ * Split a comma separated list of `pattern:value' pairs
+ */
+vector<pair<string, string>> parse_pattern_values(const string& list) {
+  vector<pair<string, string>> pairs;
+
+  for (const auto& item : parse_patterns(list)) {
+    size_t colon = item.rfind(':');
+
+    if (colon == string::npos || colon == 0) {
+      daemon_log(LOG_WARNING, "ignoring `%s', expected pattern:value", item.c_str());
+      continue;
+    }
+
+    string pattern = item.substr(0, colon);
+    string value = item.substr(colon + 1);
+    pairs.push_back({trim(pattern), trim(value)});
+  }
+
+  return pairs;
+}
+
+static bool match_any(const string& name, const vector<string>& patterns) {
+  for (const auto& pattern : patterns) {
+    if (name.find(pattern) != string::npos) return true;
+  }
+
+  return false;
+}
+
+/*
+ * Open every thermal zone whose name matches one of `include' (all if empty)
+ * and none of `exclude', the zone names are stored in `names'
+ */
+vector<sensor_t> scan_sensors(const vector<string>& include, const vector<string>& exclude,
+                              vector<string>* names) {
   glob_t glob_result;
 
+  vector<sensor_t> sensors;
   vector<string> using_sensors;
   vector<string> ignored_sensors;
 
@@ -23,16 +88,29 @@ vector<string> scan_sensors(const char* ignore_substring) {
 
     string name = read_file(sensor_name_path.c_str());
     name = trim(name);
-    unsigned temp = read_file_int(sensor_temp_path.c_str());
 
-    // name contains ignore_substring
-    // this sensor is not accurate, skip
-    if (name.find(ignore_substring) != string::npos) {
+    // the PMIC sensor is not accurate and excluded by default
+    if (match_any(name, exclude) || (!include.empty() && !match_any(name, include))) {
       ignored_sensors.push_back(sensor_temp_path);
       continue;
-    } else {
-      using_sensors.push_back(sensor_temp_path);
     }
+
+    // keep the fd open, every tick only needs a pread
+    sensor_t sensor;
+    sensor.path = sensor_temp_path;
+
+    if (!sensor_open(&sensor)) {
+      daemon_log(LOG_ERR, "cannot open `%s'", sensor_temp_path.c_str());
+      sprintf_stderr("%s: cannot open `%s'", argv0, sensor_temp_path.c_str());
+      exit(EXIT_FAILURE);
+    }
+
+    // make sure the sensor is readable
+    sensor_read_int(&sensor);
+
+    using_sensors.push_back(sensor_temp_path);
+    sensors.push_back(sensor);
+    names->push_back(name);
   }
 
   // cleanup
@@ -41,33 +119,175 @@ vector<string> scan_sensors(const char* ignore_substring) {
   debug_log("using sensors: %s", join(using_sensors, ", ").c_str());
   debug_log("ignored sensors: %s", join(ignored_sensors, ", ").c_str());
 
-  if (using_sensors.size() < 1) {
+  if (sensors.size() < 1) {
     daemon_log(LOG_ERR, "no temperature sensors found");
     sprintf_stderr("%s: no temperature sensors found", argv0);
     exit(EXIT_FAILURE);
   }
 
-  return using_sensors;
+  return sensors;
+}
+
+/*
+ * The sensor set compiled into flat arrays, indexed like the sensors
+ */
+typedef struct {
+  vector<string> names;
+  vector<uint32_t> weights;
+  vector<int32_t> curves;  // index into zone_curves or ZONE_NO_CURVE
+  vector<uint32_t> temps;  // millidegrees, filtered
+  vector<uint8_t> active;  // 0 while quarantined
+  size_t active_count = 0;
+
+  vector<sensor_filter_t> filters;
+
+  vector<fan_curve_t> zone_curves;
+} zone_set_t;
+
+/*
+ * Resolve the weights and per-zone tables of every zone, the first matching
+ * pattern wins. Exits if a zone table cannot be parsed.
+ */
+zone_set_t compile_zones(const vector<string>& names, const vector<pair<string, string>>& weights,
+                         const vector<pair<string, string>>& tables, unsigned table_step) {
+  zone_set_t zones;
+  vector<string> table_paths;
+
+  zones.names = names;
+  zones.weights.assign(names.size(), 1);
+  zones.curves.assign(names.size(), ZONE_NO_CURVE);
+  zones.temps.assign(names.size(), 0);
+  zones.active.assign(names.size(), 1);
+  zones.filters.assign(names.size(), sensor_filter_t());
+  zones.active_count = names.size();
+
+  for (size_t i = 0; i < names.size(); i++) {
+    for (const auto& weight : weights) {
+      if (names[i].find(weight.first) != string::npos) {
+        const char* text = weight.second.c_str();
+        char* end;
+        errno = 0;
+        long value = strtol(text, &end, 10);
+
+        if (end == text || *end != '\0' || errno == ERANGE || value < 0 || value > UINT32_MAX) {
+          daemon_log(LOG_WARNING, "invalid weight `%s' for %s, using 1", text, names[i].c_str());
+        } else {
+          zones.weights[i] = value;
+        }
+        break;
+      }
+    }
+
+    for (const auto& table : tables) {
+      if (names[i].find(table.first) == string::npos) continue;
+
+      // zones sharing a table share the compiled curve
+      auto found = std::find(table_paths.begin(), table_paths.end(), table.second);
+      if (found == table_paths.end()) {
+        debug_log("using table file `%s' for %s", table.second.c_str(), names[i].c_str());
+        zones.zone_curves.push_back(
+            compile_curve(parse_table(table.second.c_str(), true), table_step));
+        table_paths.push_back(table.second);
+        found = table_paths.end() - 1;
+      }
+
+      zones.curves[i] = found - table_paths.begin();
+      break;
+    }
+
+    debug_log("zone %s: weight %u%s", names[i].c_str(), zones.weights[i],
+              zones.curves[i] != ZONE_NO_CURVE ? ", own curve" : "");
+  }
+
+  return zones;
 }
 
-unsigned thermal_average(const vector<string>& sensors, bool use_max) {
-  unsigned temp_sum = 0;
-  unsigned temp_max = 0;
+/*
+ * Read and filter every sensor into the zone set, the raw reading of a
+ * quarantined sensor is kept in case every sensor ends up quarantined.
+ * The time of each read goes into `read_latency', one histogram per sensor,
+ * and into the trace.
+ */
+void thermal_update(zone_set_t* zones, vector<sensor_t>& sensors, const filter_config_t& filter,
+                    int64_t time_ms, histogram_t* read_latency = nullptr) {
+  zones->active_count = 0;
 
-  for (const auto& temp_path : sensors) {
-    unsigned temp = read_file_int(temp_path.c_str());
+  for (size_t i = 0; i < sensors.size(); i++) {
+    bool timed = read_latency || tracer.enabled;
+    int64_t read_start = timed ? now_real_us() : 0;
+    int raw = sensor_read_int(&sensors[i]);
 
-    temp_sum += temp;
-    temp_max = std::max(temp_max, temp);
+    if (timed) {
+      int64_t read_end = now_real_us();
+      if (read_latency) histogram_record(&read_latency[i], read_end - read_start);
+      if (tracer.enabled) {
+        trace_span("read", "sensor", read_start, read_end, "\"zone\":\"%s\",\"raw\":%d",
+                   trace_arg(zones->names[i].c_str()), raw);
+      }
+    }
+    bool active = filter_update(filter, &zones->filters[i], zones->names[i].c_str(), raw, time_ms);
+
+    zones->active[i] = active;
+    zones->temps[i] = std::max(active ? zones->filters[i].output : raw, 0);
+    zones->active_count += active;
   }
+}
 
-  if (use_max) {
-    return temp_max;
-  } else {
-    if (sensors.size() > 0) {
-      return temp_sum / sensors.size();
+/*
+ * Restart the filters, after the filter settings changed
+ */
+void thermal_reset_filters(zone_set_t* zones) {
+  for (auto& filter : zones->filters) filter_restart(&filter);
+}
+
+/*
+ * Weighted mean or maximum of the zones, zones with weight 0 only drive their own curve.
+ * Quarantined zones are skipped, unless all of them are.
+ */
+unsigned thermal_aggregate(const zone_set_t& zones, bool use_max) {
+  const uint32_t* temps = zones.temps.data();
+  const uint32_t* weights = zones.weights.data();
+  const uint8_t* active = zones.active.data();
+  bool all = zones.active_count == 0;
+  size_t count = zones.temps.size();
+
+  uint64_t weight_sum = 0;
+  uint64_t temp_sum = 0;
+  uint32_t temp_max = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    uint32_t weight = (active[i] || all) ? weights[i] : 0;
+
+    weight_sum += weight;
+    temp_sum += uint64_t(temps[i]) * weight;
+    if (weight > 0) temp_max = std::max(temp_max, temps[i]);
+  }
+
+  // every usable zone has weight 0
+  if (weight_sum == 0) {
+    for (size_t i = 0; i < count; i++) {
+      if (active[i] || all) temp_max = std::max(temp_max, temps[i]);
     }
+    return temp_max;
+  }
+
+  return use_max ? temp_max : temp_sum / weight_sum;
+}
+
+/*
+ * Highest speed asked by the per-zone curves, 0 if there are none
+ */
+unsigned zones_speed(const zone_set_t& zones, unsigned offset) {
+  const uint32_t* temps = zones.temps.data();
+  const int32_t* curves = zones.curves.data();
+  const uint8_t* active = zones.active.data();
+  bool all = zones.active_count == 0;
+  unsigned speed = 0;
+
+  for (size_t i = 0; i < zones.temps.size(); i++) {
+    if (curves[i] == ZONE_NO_CURVE || !(active[i] || all)) continue;
+    speed = std::max(speed, curve_lookup(zones.zone_curves[curves[i]], temps[i] + offset));
   }
 
-  return 0;
+  return speed;
 }
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "defines.h"
+#include "jetson_clocks.h"
+#include "log.h"
+#include "sensor_io.h"
+
+using std::string;
+using std::vector;
+
+// a clock below this share of its maximum (in percent) is throttled
+#define THROTTLE_TOLERANCE 98
+
+typedef struct {
+  sensor_t cur;
+  long max = 0;
+} freq_domain_t;
+
+/*
+ * Detects thermal throttling and learns a temperature offset that
+ * moves the fan curve earlier until throttling stops
+ */
+typedef struct {
+  // millidegrees
+  unsigned step = 500;
+  unsigned max_offset = 10000;
+  unsigned decay = 10;  // per tick without throttling
+
+  vector<freq_domain_t> domains;
+  bool ready = false;
+  bool throttled = false;
+  unsigned long events = 0;
+  unsigned long throttled_ticks = 0;
+  unsigned offset = 0;
+} throttle_t;
+
+static void add_freq_domain(throttle_t* throttle, const string& cur_path, const string& max_path) {
+  string value;
+  freq_domain_t domain;
+
+  if (!read_value(max_path, &value)) return;
+
+  domain.cur.path = cur_path;
+  domain.max = atol(value.c_str());
+
+  if (domain.max > 0 && sensor_open(&domain.cur)) {
+    throttle->domains.push_back(domain);
+  }
+}
+
+/*
+ * Record the maxima, must be called after the clocks are set
+ */
+void throttle_setup(throttle_t* throttle) {
+  throttle->domains.clear();
+
+  for (const auto& cpu : glob_paths(CPU_GLOB)) {
+    add_freq_domain(throttle, cpu + "/cpufreq/scaling_cur_freq", cpu + "/cpufreq/scaling_max_freq");
+  }
+
+  for (const auto& gpu : gpu_devfreq_paths()) {
+    add_freq_domain(throttle, gpu + "/cur_freq", gpu + "/max_freq");
+  }
+
+  debug_log("watching %zu clocks for throttling", throttle->domains.size());
+  throttle->ready = true;
+}
+
+static bool is_throttled(throttle_t* throttle) {
+  for (auto& domain : throttle->domains) {
+    int cur;
+
+    // offline cpus can't be read, they are not throttled
+    if (!sensor_try_read_int(&domain.cur, &cur)) continue;
+
+    if (cur * 100L < domain.max * THROTTLE_TOLERANCE) {
+      debug_log("`%s' throttled: %d < %ld", domain.cur.path.c_str(), cur, domain.max);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/*
+ * Check the clocks and update the offset
+ * returns the offset in millidegrees to add to the temperature
+ */
+unsigned throttle_update(throttle_t* throttle) {
+  bool throttled = is_throttled(throttle);
+
+  if (throttled) {
+    if (!throttle->throttled) {
+      throttle->events++;
+      daemon_log(LOG_WARNING, "clocks throttled (event %lu), curve offset %u mC",
+                 throttle->events, throttle->offset);
+    }
+
+    throttle->throttled_ticks++;
+    throttle->offset = std::min(throttle->offset + throttle->step, throttle->max_offset);
+  } else if (throttle->offset > 0) {
+    throttle->offset -= std::min(throttle->offset, throttle->decay);
+  }
+
+  throttle->throttled = throttled;
+
+  return throttle->offset;
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+/*
+ * Opt-in trace of the control loop in the Chrome trace event format,
+ * loadable in Perfetto or chrome://tracing
+ *
+ * Spans (ph "X") cover the tick, the sensor reads, the pwm writes and the
+ * clock changes, with their inputs and outputs as args. Every debug_log()
+ * message becomes an instant event (ph "i"). Timestamps are CLOCK_MONOTONIC
+ * microseconds, the clock Perfetto uses for the traces of other processes.
+ *
+ * The events go into a ring allocated when tracing is turned on, recording
+ * an event formats into its slot and never allocates. The ring is written
+ * to TRACE_PATH on SIGUSR1 and served by `fantable --trace`.
+ */
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "json.h"
+
+using std::string;
+using std::vector;
+
+#define TRACE_TEXT_SIZE 160
+
+typedef struct {
+  int64_t ts;        // microseconds
+  int64_t dur;       // microseconds, -1 for an instant event
+  const char* name;  // static strings
+  const char* category;
+  char args[TRACE_TEXT_SIZE];  // JSON object for a span, message for an instant
+} trace_event_t;
+
+typedef struct {
+  bool enabled = false;
+  vector<trace_event_t> events;
+  uint64_t head = 0;  // events recorded so far
+} tracer_t;
+
+// shared by debug_log() and the control loop
+static tracer_t tracer;
+
+/*
+ * Turn tracing on with room for `capacity' events, or off with 0
+ */
+void trace_setup(unsigned capacity) {
+  tracer.enabled = capacity > 0;
+
+  if (tracer.events.size() != capacity) {
+    tracer.events.assign(capacity, trace_event_t());
+    tracer.head = 0;
+  }
+}
+
+// now_real_us(), utils.h cannot be included from here since it includes log.h
+static inline int64_t trace_now_us() {
+  using namespace std::chrono;
+  return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static trace_event_t* trace_next(const char* name, const char* category, int64_t ts,
+                                 int64_t dur) {
+  trace_event_t* event = &tracer.events[tracer.head++ % tracer.events.size()];
+
+  event->ts = ts;
+  event->dur = dur;
+  event->name = name;
+  event->category = category;
+
+  return event;
+}
+
+/*
+ * `text' escaped for a string arg of trace_span(), cut to fit the args.
+ * The buffer is reused, one call per span.
+ */
+const char* trace_arg(const char* text) {
+  static char escaped[TRACE_TEXT_SIZE];
+  char code[8];
+  size_t n = 0;
+
+  for (const char* c = text; *c; c++) {
+    size_t length = json_escape_char(*c, code);
+    if (n + length >= sizeof(escaped)) break;
+
+    memcpy(escaped + n, code, length);
+    n += length;
+  }
+
+  escaped[n] = '\0';
+  return escaped;
+}
+
+/*
+ * A span from `start' to `end', args_format gives the members of a JSON object.
+ * Strings go through trace_arg(), args that do not fit are replaced, a cut
+ * object would break the whole trace.
+ */
+void trace_span(const char* name, const char* category, int64_t start, int64_t end,
+                const char* args_format, ...) {
+  if (!tracer.enabled) return;
+
+  trace_event_t* event = trace_next(name, category, start, end - start);
+  va_list arglist;
+
+  va_start(arglist, args_format);
+  int length = vsnprintf(event->args, sizeof(event->args), args_format, arglist);
+  va_end(arglist);
+
+  if (length < 0 || size_t(length) >= sizeof(event->args)) {
+    snprintf(event->args, sizeof(event->args), "\"truncated\":true");
+  }
+}
+
+void trace_instant_v(const char* category, const char* message, va_list arglist) {
+  if (!tracer.enabled) return;
+
+  trace_event_t* event = trace_next("log", category, trace_now_us(), -1);
+  vsnprintf(event->args, sizeof(event->args), message, arglist);
+}
+
+/*
+ * The ring as a Chrome trace JSON object, oldest event first
+ */
+string format_trace_json() {
+  string out;
+  char buf[256];
+  int pid = getpid();
+  uint64_t count = std::min<uint64_t>(tracer.head, tracer.events.size());
+
+  out.reserve(count * 200 + 256);
+  snprintf(buf, sizeof(buf),
+           "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+           "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}",
+           pid, PACKAGE_NAME);
+  out += buf;
+
+  for (uint64_t n = tracer.head - count; n < tracer.head; n++) {
+    const trace_event_t& event = tracer.events[n % tracer.events.size()];
+
+    if (event.dur >= 0) {
+      snprintf(buf, sizeof(buf),
+               ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+               "\"pid\":%d,\"tid\":%d,\"args\":{",
+               event.name, event.category, (long long)event.ts, (long long)event.dur, pid, pid);
+      out += buf;
+      out += event.args;
+    } else {
+      snprintf(buf, sizeof(buf),
+               ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%lld,"
+               "\"pid\":%d,\"tid\":%d,\"args\":{\"message\":\"",
+               event.name, event.category, (long long)event.ts, pid, pid);
+      out += buf;
+      json_escape(&out, event.args);
+      out += "\"";
+    }
+
+    out += "}}";
+  }
+
+  out += "\n]}\n";
+  return out;
+}
+
+/*
+ * Write the ring to `path', returns false on failure
+ */
+bool trace_write(const char* path) {
+  FILE* file = fopen(path, "w");
+  if (!file) return false;
+
+  string json = format_trace_json();
+  bool written = fwrite(json.data(), 1, json.size(), file) == json.size();
+
+  return fclose(file) == 0 && written;
+}
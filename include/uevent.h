@@ -0,0 +1,250 @@
+#pragma once
+
+#include <glob.h>
+#include <linux/netlink.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "defines.h"
+#include "log.h"
+#include "sensor_io.h"
+#include "utils.h"
+
+using std::string;
+using std::vector;
+
+#define UEVENT_BUFFER_SIZE 4096
+#define THERMAL_SUBSYSTEM "SUBSYSTEM=thermal"
+
+/*
+ * A writable trip point, the original value is restored on exit
+ */
+typedef struct {
+  string path;
+  int original = 0;
+} trip_point_t;
+
+/*
+ * The trip points programmed around the temperature of a single zone
+ */
+typedef struct {
+  trip_point_t high;
+  trip_point_t low;
+  bool has_low = false;
+
+  // band written last, rewritten only once the temperature leaves it
+  bool programmed = false;
+  int band_low = 0;
+  int band_high = 0;
+} zone_trips_t;
+
+static vector<zone_trips_t> zone_trips;
+static bool trips_did_set = false;
+
+/*
+ * Open a netlink socket listening for kernel uevents
+ * returns -1 on failure
+ */
+int uevent_open() {
+  struct sockaddr_nl addr;
+  int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+
+  if (fd < 0) {
+    daemon_log(LOG_WARNING, "cannot open uevent socket: %s", strerror(errno));
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_pid = 0;
+  addr.nl_groups = 1;  // kernel uevents
+
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    daemon_log(LOG_WARNING, "cannot bind uevent socket: %s", strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/*
+ * Check if a uevent message (NUL separated key=value pairs) comes from
+ * the thermal subsystem
+ */
+bool uevent_is_thermal(const char* buf, size_t len) {
+  size_t i = 0;
+
+  while (i < len) {
+    const char* field = buf + i;
+    size_t field_len = strnlen(field, len - i);
+
+    if (strncmp(field, THERMAL_SUBSYSTEM, field_len) == 0 &&
+        field_len == strlen(THERMAL_SUBSYSTEM)) {
+      return true;
+    }
+
+    i += field_len + 1;
+  }
+
+  return false;
+}
+
+/*
+ * Drain every pending message from the socket
+ * returns true if at least one of them was a thermal event
+ */
+bool uevent_drain(int fd) {
+  char buf[UEVENT_BUFFER_SIZE];
+  bool thermal = false;
+  ssize_t len;
+
+  while ((len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+    if (uevent_is_thermal(buf, len)) {
+      thermal = true;
+    }
+  }
+
+  return thermal;
+}
+
+static bool trip_point_writable(const string& path) {
+  struct stat st;
+
+  if (stat(path.c_str(), &st) != 0) return false;
+
+  return (st.st_mode & S_IWUSR) != 0;
+}
+
+/*
+ * Find the writable active trip points of a thermal zone, lowest first
+ */
+vector<trip_point_t> scan_trip_points(const string& zone_path) {
+  vector<trip_point_t> result;
+  glob_t glob_result;
+  string pattern = zone_path + "/trip_point_*_temp";
+
+  if (glob(pattern.c_str(), 0, NULL, &glob_result) != 0) {
+    return result;
+  }
+
+  for (unsigned i = 0; i < glob_result.gl_pathc; i++) {
+    string temp_path(glob_result.gl_pathv[i]);
+    string type_path = temp_path.substr(0, temp_path.size() - strlen("temp")) + "type";
+
+    if (access(type_path.c_str(), R_OK) != 0) continue;
+
+    // never move passive, hot or critical trips, the kernel throttles on those
+    string type = read_file(type_path.c_str());
+    if (trim(type) != "active") continue;
+
+    if (!trip_point_writable(temp_path)) continue;
+
+    trip_point_t trip;
+    trip.path = temp_path;
+    trip.original = read_file_int(temp_path.c_str());
+    result.push_back(trip);
+  }
+
+  globfree(&glob_result);
+
+  // glob order is not trip order, the kernel expects the values to rise with the index
+  std::sort(result.begin(), result.end(), [](const trip_point_t& a, const trip_point_t& b) {
+    return a.original < b.original;
+  });
+
+  return result;
+}
+
+/*
+ * Find two writable trips per zone to bracket its temperature, the two
+ * lowest active ones: the higher of them is moved above the temperature
+ * and the lower one below, so they keep their order
+ * returns false if no zone can be programmed, the caller should fall back to polling
+ */
+bool setup_trip_points(const vector<sensor_t>& sensors) {
+  zone_trips.clear();
+
+  for (const auto& sensor : sensors) {
+    string zone_path = sensor.path.substr(0, sensor.path.rfind('/'));
+    vector<trip_point_t> trips = scan_trip_points(zone_path);
+
+    if (trips.size() < 1) {
+      debug_log("no writable trip points in `%s'", zone_path.c_str());
+      return false;
+    }
+
+    zone_trips_t zone;
+    zone.high = trips[0];
+
+    if (trips.size() > 1) {
+      zone.low = trips[0];
+      zone.high = trips[1];
+      zone.has_low = true;
+    }
+
+    zone_trips.push_back(zone);
+  }
+
+  debug_log("using trip points of %zu thermal zones", zone_trips.size());
+
+  return zone_trips.size() > 0;
+}
+
+/*
+ * Program the trip points `window' millidegrees around the last read temperature
+ * of each zone. Cooling devices can be bound to these trips, a zone is only
+ * written again once its temperature left the band or the window changed.
+ */
+void program_trip_points(const vector<sensor_t>& sensors, unsigned window) {
+  for (size_t i = 0; i < zone_trips.size() && i < sensors.size(); i++) {
+    auto& zone = zone_trips[i];
+    int temp = sensors[i].value;
+    int high = temp + window;
+    int low = temp - window;
+
+    bool inside = temp < zone.band_high && (!zone.has_low || temp > zone.band_low);
+    bool same_window = zone.band_high - zone.band_low == 2 * int(window);
+    if (zone.programmed && inside && same_window) continue;
+
+    // never let the two cross while they are written one at a time
+    if (zone.has_low && low >= zone.band_high) {
+      write_file_int(zone.high.path.c_str(), high);
+      write_file_int(zone.low.path.c_str(), low);
+    } else {
+      if (zone.has_low) write_file_int(zone.low.path.c_str(), low);
+      write_file_int(zone.high.path.c_str(), high);
+    }
+
+    zone.programmed = true;
+    zone.band_low = low;
+    zone.band_high = high;
+  }
+
+  trips_did_set = true;
+}
+
+/*
+ * Put back the trip points as they were before the daemon started
+ */
+void restore_trip_points() {
+  if (!trips_did_set) return;
+
+  for (const auto& zone : zone_trips) {
+    // the same order as program_trip_points, high goes first unless it would cross low
+    if (zone.has_low && zone.programmed && zone.high.original < zone.band_low) {
+      write_file_int(zone.low.path.c_str(), zone.low.original);
+      write_file_int(zone.high.path.c_str(), zone.high.original);
+    } else {
+      write_file_int(zone.high.path.c_str(), zone.high.original);
+      if (zone.has_low) write_file_int(zone.low.path.c_str(), zone.low.original);
+    }
+  }
+}
@@ -3,6 +3,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <chrono>
 #include <cerrno>
 #include <cstring>
 #include <fstream>
@@ -191,7 +192,7 @@ static string& join(const vector<string>& elems, string& s, string delim) {
   return s;
 }
 
-static string join(const vector<string>& elems, string delim) {
+static inline string join(const vector<string>& elems, string delim) {
   string s;
   return join(elems, s, delim);
 }
@@ -212,6 +213,40 @@ bool is_only_ascii_whitespace(const string& str) {
   return false;
 }
 
+// set by --simulate, the clock then only moves when the simulation advances it
+static int64_t virtual_clock_us = -1;
+
+/*
+ * Monotonic time in microseconds
+ */
+inline int64_t now_us() {
+  using namespace std::chrono;
+  if (virtual_clock_us >= 0) return virtual_clock_us;
+  return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Monotonic time in milliseconds
+ */
+inline int64_t now_ms() { return now_us() / 1000; }
+
+/*
+ * Monotonic time in microseconds, ignores the virtual clock
+ */
+inline int64_t now_real_us() {
+  using namespace std::chrono;
+  return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Wall clock in milliseconds, the virtual clock counts from the epoch
+ */
+inline int64_t wall_ms() {
+  using namespace std::chrono;
+  if (virtual_clock_us >= 0) return virtual_clock_us / 1000;
+  return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+}
+
 bool is_sudo_or_root() {
   if (geteuid() == 0) return true;
   return false;
@@ -1,21 +1,40 @@
 #include <assert.h>
 #include <getopt.h>
+#include <poll.h>
 
 #include <algorithm>
-#include <chrono>
-#include <thread>
 
+#include "actuator.h"
 #include "atexit.h"
+#include "characterize.h"
 #include "config.h"
+#include "control.h"
 #include "defines.h"
+#include "governor.h"
 #include "interpolate.h"
 #include "jetson_clocks.h"
 #include "load_config.h"
+#include "mpc.h"
+#include "notify.h"
+#include "load.h"
 #include "log.h"
 #include "parse_table.h"
 #include "pid.h"
+#include "pid_controller.h"
+#include "plant.h"
+#include "reactor.h"
+#include "recorder.h"
+#include "reload.h"
+#include "scheduler.h"
+#include "simulation.h"
+#include "state.h"
 #include "status.h"
+#include "tach.h"
+#include "telemetry.h"
 #include "thermal.h"
+#include "throttle.h"
+#include "trace.h"
+#include "uevent.h"
 #include "utils.h"
 
 using std::string;
@@ -36,11 +55,25 @@ void print_help_exit() {
       "    -t --enable-tach                Enable the fan tachometer for speed monitoring\n"
       "    -c --check                      Returns 0 if process is running\n"
       "    -s --status                     Print process status\n"
-      "                                    Can be used with options -I and -A\n"
+      "       --json                       Print the status as JSON\n"
+      "       --reset-latency              Clear the latency histograms shown by --status\n"
+      "       --trace                      Print the trace of the last ticks as Chrome trace\n"
+      "                                    JSON (needs trace = yes in the config)\n"
+      "    -w --watch                      Follow the temperature and fan speed\n"
       "    -M --no-max-freq                Do not set CPU and GPU clocks\n"
       "    -A --no-average                 Use the highest measured temperature instead of\n"
       "                                    calculating the average\n"
-      "    -I --ignore-sensors <string>    Ignore sensors that match a substring (case sensitive)\n"
+      "    -I --ignore-sensors <list>      Ignore sensors that match any of the comma separated\n"
+      "                                    substrings (case sensitive)\n"
+      "       --dump-curve                 Print the compiled fan curve and exit\n"
+      "       --dump                       Print the recorded history as CSV (or JSON with --json)\n"
+      "       --characterize               Sweep the fan speed and print a table for the target\n"
+      "                                    temperature set in the config\n"
+      "       --simulate                   Characterize a simulated board instead of this one,\n"
+      "                                    or run the daemon on a simulated board under --root\n"
+      "       --ticks <int>                Ticks to run with --simulate (defaults to 1000)\n"
+      "       --csv <path>                 Where --characterize writes the sweep data\n"
+      "       --root <path>                Prefix of every sysfs and configuration path\n"
       "       --debug                      Increase verbosity in syslog\n",
       // clang-format on
       argv0);
@@ -56,6 +89,11 @@ int main(int argc, char* argv[]) {
   pid_t pid;
   options_t oobj;
 
+  // --root overrides it
+  if (const char* root = getenv("FANTABLE_ROOT")) {
+    set_path_root(root);
+  }
+
   // clang-format off
   static const struct option long_options[] = {
     {"help",            no_argument,        NULL, 'h'},
@@ -67,12 +105,23 @@ int main(int argc, char* argv[]) {
     {"no-max-freq",     no_argument,        NULL, 'M'},
     {"no-average",      no_argument,        NULL, 'A'},
     {"ignore-sensors",  required_argument,  NULL, 'I'},
+    {"json",            no_argument,        NULL, OPTION_JSON},
+    {"watch",           no_argument,        NULL, 'w'},
+    {"reset-latency",   no_argument,        NULL, OPTION_RESET_LATENCY},
+    {"trace",           no_argument,        NULL, OPTION_TRACE},
+    {"dump-curve",      no_argument,        NULL, OPTION_DUMP_CURVE},
+    {"dump",            no_argument,        NULL, OPTION_DUMP},
+    {"characterize",    no_argument,        NULL, OPTION_CHARACTERIZE},
+    {"simulate",        no_argument,        NULL, OPTION_SIMULATE},
+    {"csv",             required_argument,  NULL, OPTION_CSV},
+    {"root",            required_argument,  NULL, OPTION_ROOT},
+    {"ticks",           required_argument,  NULL, OPTION_TICKS},
     {"debug",           no_argument,        NULL, OPTION_DEBUG},
     {NULL,              0,                  NULL, 0}};
   // clang-format on
 
   int opt;
-  while ((opt = getopt_long(argc, argv, "hvcsi:tMAI:", long_options, NULL)) >= 0) {
+  while ((opt = getopt_long(argc, argv, "hvcswi:tMAI:", long_options, NULL)) >= 0) {
     switch (opt) {
       case 'h':
         oobj.help = true;
@@ -89,6 +138,9 @@ int main(int argc, char* argv[]) {
       case 's':
         oobj.status = true;
         break;
+      case 'w':
+        oobj.watch = true;
+        break;
       case 'M':
         enable_max_freq = false;
         break;
@@ -107,6 +159,42 @@ int main(int argc, char* argv[]) {
       case 'I':
         oobj.substring = optarg;
         break;
+      case OPTION_JSON:
+        oobj.status = true;
+        oobj.json = true;
+        break;
+      case OPTION_DUMP_CURVE:
+        oobj.dump_curve = true;
+        break;
+      case OPTION_RESET_LATENCY:
+        oobj.reset_latency = true;
+        break;
+      case OPTION_TRACE:
+        oobj.print_trace = true;
+        break;
+      case OPTION_DUMP:
+        oobj.dump = true;
+        break;
+      case OPTION_CHARACTERIZE:
+        oobj.characterize = true;
+        break;
+      case OPTION_SIMULATE:
+        oobj.simulate = true;
+        break;
+      case OPTION_CSV:
+        oobj.csv_path = optarg;
+        break;
+      case OPTION_ROOT:
+        set_path_root(optarg);
+        break;
+      case OPTION_TICKS:
+        try {
+          oobj.ticks = std::stoul(optarg);
+        } catch (...) {
+          fprintf(stderr, "%s: cannot parse argument `%s' for --ticks\n", argv0, optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
       case OPTION_DEBUG:
         enable_debug = true;
         break;
@@ -148,9 +236,62 @@ int main(int argc, char* argv[]) {
   // --help, --version and --check don't need the config
   load_config(&oobj);
 
+  const char* csv_path = oobj.csv_path.empty() ? CHARACTERIZE_CSV_PATH : oobj.csv_path.c_str();
+
+  if (oobj.dump) {
+    // print the recorded history and exit, --json only picks the format
+    dump_records(oobj.json);
+  }
+
+  if (oobj.reset_latency) {
+    print_status(false, "reset-latency");
+  }
+
+  if (oobj.print_trace) {
+    // the daemon's ring, not this process'
+    print_trace();
+  }
+
   if (oobj.status) {
     // print daemon status + information and exit
-    print_status(oobj.substring.c_str(), oobj.use_highest);
+    print_status(oobj.json);
+  }
+
+  if (oobj.watch) {
+    // follow the telemetry ring, does not return
+    watch_status();
+  }
+
+  if (oobj.dump_curve) {
+    // print the compiled table and exit
+    vector<coord_t> table_config = parse_table(TABLE_PATH, true);
+    if (table_config.size() < 1) {
+      sprintf_stderr("%s: empty table configuration at `%s'", argv0, TABLE_PATH);
+      exit(EXIT_FAILURE);
+    }
+
+    dump_curve(compile_curve(table_config, oobj.table_step));
+    exit(EXIT_SUCCESS);
+  }
+
+  if (oobj.characterize && oobj.simulate) {
+    // no hardware is touched, the simulated time runs as fast as it can
+    const unsigned sim_pwm_cap = 255;
+    plant_t plant;
+    plant.ambient = plant.temp = oobj.sweep.ambient / 1000.0;
+    plant.load = oobj.sweep_load ? 1.0 : 0.5;
+
+    plant_io_t io;
+    io.set_pwm = [&](unsigned value) { plant.pwm = double(value) / sim_pwm_cap; };
+    io.read_temp = [&]() { return plant_temp(&plant); };
+    io.read_rpm = [&]() { return plant_rpm(&plant); };
+    io.wait = [&](unsigned ms) {
+      plant_step(&plant, ms / 1000.0);
+      return true;
+    };
+
+    bool done = characterize(io, oobj.sweep, sim_pwm_cap, csv_path);
+    exit(done ? EXIT_SUCCESS : EXIT_FAILURE);
   }
 
 #ifdef DEBUG_OPTIONS
@@ -167,7 +308,22 @@ int main(int argc, char* argv[]) {
   std::cout << "enable_tach     " << enable_tach << std::endl;
 #endif
 
-  if (!is_sudo_or_root()) {
+  bool simulate_loop = oobj.simulate && !oobj.characterize;
+
+  if (simulate_loop) {
+    if (path_root.empty()) {
+      sprintf_stderr("%s: --simulate needs a fake tree, set one with --root", argv0);
+      exit(EXIT_FAILURE);
+    }
+
+    // nothing to wait for on a fake tree, time only moves with the ticks
+    virtual_clock_us = 0;
+    enable_max_freq = false;
+    oobj.event_driven = false;
+  }
+
+  // a fake tree belongs to whoever created it
+  if (path_root.empty() && !is_sudo_or_root()) {
     daemon_log(LOG_INFO, "requested operation requires superuser privilege");
     sprintf_stderr("%s: requested operation requires superuser privilege", argv0);
     exit(EACCES);
@@ -176,7 +332,10 @@ int main(int argc, char* argv[]) {
   // Start logging
   daemon_log(LOG_INFO, "Starting fan control daemon...");
 
-  register_exit_handler();
+  // before the first debug_log() worth keeping
+  trace_setup(oobj.trace ? oobj.trace_events : 0);
+
+  int signal_fd = register_exit_handler();
 
   /*
    * check and set pid file
@@ -207,10 +366,19 @@ int main(int argc, char* argv[]) {
     is_first_run = true;
   }
 
-  // cleanup before jetson_clocks saves again
+  // cleanup before saving again
   remove_file(STORE_FILE);
   daemon_log(LOG_INFO, "saving state to: `%s'", is_first_run ? INITIAL_STORE_FILE : STORE_FILE);
+  int64_t store_start = now_real_us();
   store_config(is_first_run ? INITIAL_STORE_FILE : STORE_FILE);
+  trace_span("store_config", "clocks", store_start, now_real_us(), "\"first_run\":%s",
+             is_first_run ? "true" : "false");
+
+  // the rpm mode needs the tachometer
+  if (oobj.mode == MODE_RPM && !enable_tach) {
+    daemon_log(LOG_INFO, "mode rpm enables the tachometer");
+    enable_tach = true;
+  }
 
   // enbale tachomenter
   if (enable_tach) {
@@ -220,14 +388,28 @@ int main(int argc, char* argv[]) {
   }
 
   debug_log("using interval of %d seconds", oobj.interval);
-  std::chrono::seconds interval(oobj.interval);
 
   unsigned temperature;
-  int temperature_old = -1;
-  unsigned pwm;
+  unsigned pwm = 0;
+
+
+  scheduler_t scheduler;
+  auto configure_scheduler = [&]() {
+    scheduler.min_interval = oobj.min_interval;
+    scheduler.max_interval = oobj.max_interval;
+    scheduler.slope_high = oobj.slope_high;
+    scheduler.slope_low = oobj.slope_low;
+    scheduler.steep_segment = oobj.steep_segment;
+    scheduler.interval = std::clamp(oobj.interval * 1000, oobj.min_interval, oobj.max_interval);
 
-  // we can also skip if the process starts after nvpmodel.service
-  unsigned clocks_wait = MAX_FREQ_WAIT / oobj.interval;
+    debug_log("using adaptive interval between %u and %u ms", oobj.min_interval,
+              oobj.max_interval);
+  };
+
+  if (oobj.adaptive_interval) {
+    configure_scheduler();
+  }
+  unsigned interval_ms = oobj.interval * 1000;
 
   if (oobj.use_highest) {
     debug_log("using highest measured temperature");
@@ -254,56 +436,595 @@ int main(int argc, char* argv[]) {
     }
   }
 
+  // compile once, every tick is a single lookup
+  fan_curve_t curve = compile_curve(table_config, oobj.table_step);
+  debug_log("compiled curve: %zu entries, step %u mC", curve.speed.size(), curve.step);
+
   debug_log("reading pwm_cap file `%s'", PWM_CAP_PATH);
   unsigned pwm_cap = read_file_int(PWM_CAP_PATH);
 
   /*
    * scan temperature sensors
    */
-  debug_log("ignoring sensor containing `%s'", oobj.substring.c_str());
-  vector<string> sensor_paths = scan_sensors(oobj.substring.c_str());
+  debug_log("ignoring sensors containing `%s'", oobj.substring.c_str());
+  vector<string> sensor_names;
+  vector<sensor_t> sensors = scan_sensors(parse_patterns(oobj.include_sensors),
+                                          parse_patterns(oobj.substring), &sensor_names);
+
+  // weights and per-zone curves, evaluated every tick
+  zone_set_t zones = compile_zones(sensor_names, parse_pattern_values(oobj.sensor_weights),
+                                   parse_pattern_values(oobj.zone_tables), oobj.table_step);
+
+  /*
+   * sweep the fan instead of controlling it
+   */
+  if (oobj.characterize) {
+    sensor_t tach_sensor;
+    tach_sensor.path = MEASURED_RPM_PATH;
+    if (enable_tach) sensor_open(&tach_sensor);
+
+    plant_io_t io;
+    io.set_pwm = [&](unsigned value) { write_file_int(TARGET_PWM_PATH, value); };
+    io.read_temp = [&]() {
+      thermal_update(&zones, sensors, oobj.filter, now_ms());
+      return thermal_aggregate(zones, oobj.use_highest);
+    };
+    io.read_rpm = [&]() {
+      int value;
+      return enable_tach && sensor_try_read_int(&tach_sensor, &value) ? value : -1;
+    };
+    io.wait = [&](unsigned ms) {
+      // SIGINT and SIGTERM are only delivered through the signalfd
+      struct pollfd pfd = {signal_fd, POLLIN, 0};
+      if (poll(&pfd, 1, ms) > 0) {
+        sprintf_stderr("%s: interrupted by signal %d", argv0, read_signal(signal_fd));
+        return false;
+      }
+      return true;
+    };
+
+    vector<pid_t> load_pids;
+    if (oobj.sweep_load) load_pids = start_load();
+
+    bool done = characterize(io, oobj.sweep, pwm_cap, csv_path);
+    stop_load(load_pids);
+
+    errno = done ? EXIT_SUCCESS : EXIT_FAILURE;
+    exit_handler(errno);
+  }
+
+  /*
+   * wake up on trip point events instead of polling
+   */
+  int uevent_fd = -1;
+  if (oobj.event_driven) {
+    if (setup_trip_points(sensors) && (uevent_fd = uevent_open()) >= 0) {
+      daemon_log(LOG_INFO, "waiting for trip point events, window %u mC", oobj.event_window);
+    } else {
+      daemon_log(LOG_WARNING, "trip points are not writable, falling back to polling");
+    }
+  }
+
+  /*
+   * feed-forward from cpu and gpu load
+   */
+  load_t load;
+  auto configure_load = [&]() {
+    load.cpu_weight = oobj.ff_cpu_weight;
+    load.gpu_weight = oobj.ff_gpu_weight;
+    load.psi_weight = oobj.ff_psi_weight;
+    load.max_boost = oobj.ff_max_boost;
+  };
+
+  configure_load();
+  if (oobj.feedforward || oobj.mode == MODE_MPC) {
+    load_open(&load);
+  }
+
+  if (oobj.feedforward) {
+    debug_log("using load feed-forward, up to %u%%", load.max_boost);
+  }
+
+  /*
+   * pwm shaping
+   */
+  actuator_t actuator;
+  auto configure_actuator = [&]() {
+    actuator.hysteresis = oobj.hysteresis;
+    actuator.min_delta = oobj.pwm_min_delta;
+    actuator.slew_up = oobj.pwm_slew_up;
+    actuator.slew_down = oobj.pwm_slew_down;
+    actuator.kick = oobj.spinup_kick;
+  };
+  configure_actuator();
+
+  /*
+   * tachometer feedback
+   */
+  tach_t tach;
+  auto configure_tach = [&]() {
+    tach.rpm_max = oobj.rpm_max;
+    tach.ki = oobj.rpm_ki;
+    tach.stall_rpm = oobj.stall_rpm;
+    tach.stall_ticks = oobj.stall_ticks;
+  };
+  configure_tach();
+
+  if (oobj.mode == MODE_RPM) {
+    debug_log("table speeds are a share of %u rpm", tach.rpm_max);
+  }
+
+  /*
+   * clock limits beyond full fan speed
+   */
+  governor_t governor;
+  auto configure_governor = [&]() {
+    governor.trigger = oobj.dvfs_trigger;
+    governor.release = oobj.dvfs_release;
+    governor.hold = oobj.dvfs_hold;
+    governor.floor = std::min(oobj.dvfs_floor, 100u);
+  };
+  configure_governor();
+
+  /*
+   * temperature setpoint
+   */
+  pid_controller_t controller;
+  auto configure_pid = [&]() {
+    controller.setpoint = oobj.pid_setpoint;
+    controller.kp = oobj.pid_kp;
+    controller.ki = oobj.pid_ki;
+    controller.kd = oobj.pid_kd;
+    controller.d_filter = oobj.pid_d_filter;
+  };
+  configure_pid();
+
+  if (oobj.mode == MODE_PID) {
+    debug_log("holding %u.%03uC with kp %g, ki %g, kd %g", controller.setpoint / 1000,
+              controller.setpoint % 1000, controller.kp, controller.ki, controller.kd);
+  }
+
+  /*
+   * model predictive control
+   */
+  mpc_t mpc;
+  mpc_reset(&mpc);
+  auto configure_mpc = [&]() {
+    mpc.ceiling = oobj.mpc_ceiling;
+    mpc.horizon = oobj.mpc_horizon;
+    mpc.forgetting = oobj.mpc_forgetting;
+  };
+  configure_mpc();
+
+  if (oobj.mode == MODE_MPC) {
+    if (mpc_load(&mpc, MODEL_STATE_PATH)) {
+      daemon_log(LOG_INFO, "loaded thermal model: tau %.1f s, gain %.3f C/%%, %lu samples",
+                 mpc_time_constant(&mpc), mpc_gain(&mpc), mpc.samples);
+    }
+    debug_log("using model predictive control, ceiling %u mC", mpc.ceiling);
+  }
+
+  /*
+   * curve adaptation to thermal throttling
+   */
+  throttle_t throttle;
+  auto configure_throttle = [&]() {
+    throttle.step = oobj.throttle_step;
+    throttle.max_offset = oobj.throttle_max_offset;
+    throttle.decay = oobj.throttle_decay;
+    throttle.offset = std::min(throttle.offset, throttle.max_offset);
+  };
+  configure_throttle();
+
+  /*
+   * fan feedback for the status snapshot
+   */
+  sensor_t cur_pwm_sensor;
+  sensor_t rpm_sensor;
+
+  cur_pwm_sensor.path = CUR_PWM_PATH;
+  sensor_open(&cur_pwm_sensor);
+
+  if (enable_tach) {
+    rpm_sensor.path = MEASURED_RPM_PATH;
+    sensor_open(&rpm_sensor);
+  }
+
+  telemetry_t telemetry;
+  if (oobj.telemetry && telemetry_create(&telemetry, sensors.size())) {
+    debug_log("publishing telemetry to `%s'", TELEMETRY_PATH);
+  }
+
+  auto configure_recorder = [&]() {
+    recorder.flush = oobj.recorder_flush;
+    recorder.file_size = std::max(oobj.recorder_file_size, 1u);
+    recorder.file_age = oobj.recorder_file_age;
+    recorder.files = std::max(oobj.recorder_files, 1u);
+  };
+  configure_recorder();
+
+  // zones, then the aggregate, target pwm, cur_pwm and rpm
+  vector<int32_t> record_values(sensors.size() + RECORD_FIXED_VALUES);
+  recorder_open(&recorder, zones.names);
+
+  if (oobj.recorder) {
+    debug_log("recording the history, written every %u seconds", recorder.flush);
+  }
+
+  daemon_state.start_time = now_ms();
+  daemon_state.sensors = &sensors;
+  daemon_state.zones = &zones;
+
+  latency_t latency;
+  latency.sensor_read.assign(sensors.size(), histogram_t());
+  latency.since = now_ms();
+  daemon_state.latency = &latency;
+  daemon_state.mode = control_mode_names[oobj.mode];
 
   /*
    * daemon loop
    */
-  while (true) {
-    temperature = thermal_average(sensor_paths, oobj.use_highest);
-    temperature /= 1000;
-
-    if (enable_max_freq) {
-      // if fantable runs AFTER nvpmodel.service this should not be necessary
-      if (clocks_wait <= 0) {
-        if (clocks_did_set == false) {
-          debug_log("maxing out clock frequencies");
-          clocks_max_freq();
-          clocks_did_set = true;
+  reactor_t reactor;
+  tick_timer_t timer;
+
+  auto write_pwm = [&](unsigned requested) {
+    debug_log("target_pwm: %d (requested %u)", pwm, requested);
+    debug_log("writing pwm to `%s'", TARGET_PWM_PATH);
+    int64_t write_start = now_real_us();
+    write_file_int(TARGET_PWM_PATH, pwm);
+    int64_t write_end = now_real_us();
+    histogram_record(&latency.pwm_write, write_end - write_start);
+    trace_span("pwm_write", "fan", write_start, write_end, "\"pwm\":%u,\"requested\":%u", pwm,
+               requested);
+  };
+
+  // ends the spin-up kick, a simulation ends it on the next tick
+  int kick_fd = simulate_loop ? -1 : oneshot_create();
+
+  auto tick = [&]() {
+    int64_t tick_start = now_us();
+    // durations are measured on the real clock, also under --simulate
+    int64_t real_start = now_real_us();
+
+    thermal_update(&zones, sensors, oobj.filter, tick_start / 1000, latency.sensor_read.data());
+
+    int64_t aggregate_start = now_real_us();
+    temperature = thermal_aggregate(zones, oobj.use_highest);
+    histogram_record(&latency.aggregate, now_real_us() - aggregate_start);
+
+    // a learned offset moves the curve earlier while the clocks are throttled
+    unsigned offset = 0;
+    // the governor and the stall protection lower the limits themselves, that is not throttling
+    if (oobj.throttle_adapt && clocks_did_set && governor.level == 0 && capped_values.empty()) {
+      if (!throttle.ready) throttle_setup(&throttle);
+      offset = throttle_update(&throttle);
+    }
+
+    size_t index = curve_index(curve, temperature + offset);
+    unsigned speed = curve.speed[index];
+
+    if (oobj.feedforward || oobj.mode == MODE_MPC) {
+      load_sample(&load);
+    }
+
+    // the table is used until the model is good enough
+    if (oobj.mode == MODE_MPC) {
+      mpc_update(&mpc, temperature, load_max(&load), now_ms());
+      if (mpc_valid(&mpc)) {
+        speed = mpc_choose(&mpc, temperature + offset, load_max(&load));
+      }
+    } else if (oobj.mode == MODE_PID) {
+      speed = pid_update(&controller, temperature + offset, now_ms());
+    }
+
+    // a zone with its own curve can only raise the speed
+    speed = std::max(speed, zones_speed(zones, offset));
+
+    // the fan answers the pwm written on the last tick
+    int value;
+    int rpm = enable_tach && sensor_try_read_int(&rpm_sensor, &value) ? value : -1;
+
+    if (enable_tach && stall_update(&tach, pwm, rpm)) {
+      int64_t clocks_start = now_real_us();
+      if (tach.stalled && oobj.stall_protect) {
+        clocks_cap_freq();
+        trace_span("cap_freq", "clocks", clocks_start, now_real_us(), "\"rpm\":%d", rpm);
+      } else if (!tach.stalled) {
+        clocks_uncap_freq();
+        trace_span("uncap_freq", "clocks", clocks_start, now_real_us(), "\"rpm\":%d", rpm);
+      }
+    }
+
+    speed = actuator_hysteresis(&actuator, speed, temperature + offset);
+
+    // the table is in rpm, the inner loop finds the pwm
+    if (oobj.mode == MODE_RPM) {
+      speed = rpm_control(&tach, speed, rpm, tick_start / 1000);
+    }
+
+    unsigned control_speed = speed;
+    unsigned boost = oobj.feedforward ? load_boost(&load) : 0;
+    speed = std::min(speed + boost, 100u * CURVE_SPEED_SCALE);
+
+    unsigned target_pwm = speed * pwm_cap / (100 * CURVE_SPEED_SCALE);
+
+    if (actuator_shape(&actuator, target_pwm, pwm_cap, tick_start / 1000, &pwm)) {
+      // print PWM speed from table before its changed
+      debug_log("temperature: %u.%03uC", temperature / 1000, temperature % 1000);
+      debug_log("fan speed: %u.%02u%%", speed / CURVE_SPEED_SCALE, speed % CURVE_SPEED_SCALE);
+      write_pwm(target_pwm);
+
+      // the kick ends on its own timer, not at the next tick
+      if (actuator.kick_until > 0 && kick_fd >= 0) {
+        oneshot_arm(kick_fd, actuator.kick_until - tick_start / 1000);
+      }
+    }
+
+    if (oobj.dvfs_governor) {
+      int64_t governor_start = now_real_us();
+      if (governor_update(&governor, temperature, pwm, pwm_cap)) {
+        trace_span("governor", "clocks", governor_start, now_real_us(), "\"level\":%u",
+                   governor.level);
+      }
+    }
+
+    if (oobj.mode == MODE_MPC) {
+      mpc_applied(&mpc, pwm * 100.0 / pwm_cap);
+    }
+
+    if (uevent_fd >= 0) {
+      program_trip_points(sensors, oobj.event_window);
+      timer_set_period(&timer, oobj.event_timeout * 1000);
+    } else if (oobj.adaptive_interval) {
+      unsigned next = scheduler_update(&scheduler, curve, temperature);
+      if (next != interval_ms) {
+        interval_ms = next;
+        timer_set_period(&timer, interval_ms);
+      }
+    }
+
+    daemon_state.temperature = temperature;
+    daemon_state.speed = control_speed;
+    daemon_state.boost = boost;
+    daemon_state.throttle_offset = offset;
+    daemon_state.throttle_events = throttle.events;
+    daemon_state.throttled_ticks = throttle.throttled_ticks;
+    daemon_state.mpc_active = oobj.mode == MODE_MPC && mpc_valid(&mpc);
+    daemon_state.mpc_samples = mpc.samples;
+    daemon_state.mpc_time_constant = mpc_time_constant(&mpc);
+    daemon_state.mpc_gain = mpc_gain(&mpc);
+    daemon_state.pid_setpoint = controller.setpoint;
+    daemon_state.pid_integral = controller.integral;
+    daemon_state.target_pwm = pwm;
+    daemon_state.requested_pwm = target_pwm;
+    daemon_state.pwm_writes = actuator.writes;
+    daemon_state.pwm_writes_avoided = actuator.writes_avoided;
+    daemon_state.cur_pwm = sensor_try_read_int(&cur_pwm_sensor, &value) ? value : -1;
+    daemon_state.rpm = rpm;
+    daemon_state.rpm_target = oobj.mode == MODE_RPM ? int(tach.target) : -1;
+    daemon_state.fan_stalled = tach.stalled;
+    daemon_state.fan_stalls = tach.stalls;
+    daemon_state.dvfs_level = governor.level;
+    daemon_state.dvfs_max_level = governor.max_level;
+    daemon_state.dvfs_steps = governor.steps_down;
+    daemon_state.interval = timer.period;
+    daemon_state.ticks++;
+    daemon_state.last_tick = tick_start / 1000;
+    daemon_state.tick_duration = now_real_us() - real_start;
+
+    telemetry_publish(&telemetry, telemetry_sample(sensors, temperature, pwm, daemon_state.rpm));
+
+    if (oobj.recorder) {
+      for (size_t i = 0; i < sensors.size(); i++) record_values[i] = sensors[i].value;
+      record_values[sensors.size()] = temperature;
+      record_values[sensors.size() + 1] = pwm;
+      record_values[sensors.size() + 2] = daemon_state.cur_pwm;
+      record_values[sensors.size() + 3] = daemon_state.rpm;
+      recorder_append(&recorder, wall_ms(), record_values);
+    }
+
+    int64_t real_end = now_real_us();
+    histogram_record(&latency.tick, real_end - real_start);
+    trace_span("tick", "control", real_start, real_end,
+               "\"temperature\":%u,\"offset\":%u,\"speed\":%u,\"boost\":%u,"
+               "\"requested_pwm\":%u,\"pwm\":%u,\"rpm\":%d,\"mode\":\"%s\"",
+               temperature, offset, control_speed, boost, target_pwm, pwm, rpm,
+               control_mode_names[oobj.mode]);
+  };
+
+  /*
+   * swap in the new table and config between ticks,
+   * the fan and the clocks are left alone
+   */
+  auto reload = [&]() {
+    daemon_log(LOG_INFO, "reloading `%s' and `%s'", TABLE_PATH, CONFIG_FILE_PATH);
+    sd_notify("RELOADING=1");
+
+    bool reloaded = load_new_config(&oobj, &curve);
+    sd_notify("READY=1");
+
+    if (!reloaded) {
+      sd_notify_status("invalid configuration, using the previous one");
+      return;
+    }
+
+    // force a new pwm write with the new curve
+    configure_actuator();
+    configure_tach();
+    configure_governor();
+    actuator_force(&actuator);
+
+    // the governor was turned off, give the clocks back
+    if (!oobj.dvfs_governor && governor.level > 0) {
+      governor.level = 0;
+      governor_restore();
+    }
+    debug_log("compiled curve: %zu entries, step %u mC", curve.speed.size(), curve.step);
+
+    configure_load();
+    configure_recorder();
+    // the recorder was turned off, write what it has
+    if (!oobj.recorder) recorder_close(&recorder);
+    configure_throttle();
+    configure_mpc();
+    configure_pid();
+    thermal_reset_filters(&zones);
+    trace_setup(oobj.trace ? oobj.trace_events : 0);
+
+    if (oobj.adaptive_interval) {
+      configure_scheduler();
+    } else if (uevent_fd < 0) {
+      interval_ms = oobj.interval * 1000;
+      timer_set_period(&timer, interval_ms);
+    }
+
+    daemon_log(LOG_INFO, "configuration reloaded");
+    sd_notify_status("configuration reloaded");
+  };
+
+  reactor_init(&reactor);
+
+  reactor_add(&reactor, signal_fd, [&](uint32_t) {
+    int signo;
+    while ((signo = read_signal(signal_fd)) > 0) {
+      if (signo == SIGHUP) {
+        reload();
+      } else if (signo == SIGUSR1) {
+        if (!tracer.enabled) {
+          daemon_log(LOG_INFO, "received SIGUSR1 but tracing is disabled");
+          continue;
+        }
+
+        mkdir(STATE_DIR, 0755);
+        if (trace_write(TRACE_PATH)) {
+          daemon_log(LOG_INFO, "trace written to `%s'", TRACE_PATH);
+        } else {
+          daemon_log(LOG_WARNING, "cannot write `%s': %s", TRACE_PATH, strerror(errno));
         }
       } else {
-        clocks_wait--;
+        daemon_log(LOG_INFO, "received signal %d, shutting down", signo);
+        reactor_stop(&reactor);
       }
     }
+  });
 
-    if (temperature != temperature_old) {
-      pwm = interpolate(table_config, temperature);
+  timer_start(&timer, uevent_fd >= 0 ? oobj.interval * 1000 : interval_ms);
+  // a simulation ticks on its own clock, the timer only keeps the period
+  if (!simulate_loop) {
+    reactor_add(&reactor, timer.fd, [&](uint32_t) {
+      if (timer_expired(&timer) > 0) {
+        histogram_record(&latency.wakeup, timer_lateness_us(&timer));
+        tick();
+      }
+    });
 
-      // print PWM speed from table before its changed
-      debug_log("temperature: %dC", temperature);
-      debug_log("fan speed: %d%%", pwm);
+    reactor_add(&reactor, kick_fd, [&](uint32_t) {
+      uint64_t expirations;
+      if (read(kick_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+
+      if (actuator_kick_end(&actuator, now_ms(), &pwm)) {
+        debug_log("spin-up kick over");
+        write_pwm(actuator.target);
+        daemon_state.target_pwm = pwm;
+      }
+    });
+  }
 
-      pwm = pwm * pwm_cap / 100;
+  if (uevent_fd >= 0) {
+    reactor_add(&reactor, uevent_fd, [&](uint32_t) {
+      if (uevent_drain(uevent_fd)) {
+        debug_log("woken up by thermal event");
+        tick();
+      }
+    });
+  }
 
-      // make sure it's between the bounds
-      pwm = std::clamp(pwm, unsigned(0), pwm_cap);
+  control_t control;
+  control.fd = control_open(CONTROL_SOCKET_PATH);
+  if (control.fd >= 0) {
+    reactor_add(&reactor, control.fd,
+                [&](uint32_t) { control_handle(&reactor, &control, daemon_state); });
+  }
 
-      debug_log("target_pwm: %d", pwm);
-      debug_log("writing pwm to `%s'", TARGET_PWM_PATH);
-      write_file_int(TARGET_PWM_PATH, pwm);
+  int inotify_fd = watch_config();
+  if (inotify_fd >= 0) {
+    reactor_add(&reactor, inotify_fd, [&](uint32_t) {
+      if (config_changed(inotify_fd)) {
+        reload();
+      }
+    });
+  }
+
+  /*
+   * max out the clocks as soon as nvpmodel is done changing the power model,
+   * if fantable runs AFTER nvpmodel.service this happens after the first reads
+   */
+  tick_timer_t settle_timer;
+  freq_settle_t settle;
+  int64_t clocks_deadline = now_ms() + MAX_FREQ_WAIT * 1000;
+
+  if (enable_max_freq) {
+    sd_notify_status("waiting for the power model to settle");
+
+    timer_start(&settle_timer, FREQ_SETTLE_INTERVAL);
+    reactor_add(&reactor, settle_timer.fd, [&](uint32_t) {
+      if (timer_expired(&settle_timer) == 0) return;
+
+      bool settled = clocks_settled(&settle);
+      if (!settled && now_ms() < clocks_deadline) return;
+
+      if (!settled) {
+        daemon_log(LOG_WARNING, "power model did not settle in %d seconds", MAX_FREQ_WAIT);
+      }
+
+      debug_log("maxing out clock frequencies");
+      int64_t clocks_start = now_real_us();
+      clocks_max_freq();
+      trace_span("max_freq", "clocks", clocks_start, now_real_us(), "\"settled\":%s",
+                 settled ? "true" : "false");
+      clocks_did_set = true;
+      sd_notify_status("running, clocks set to maximum");
+
+      reactor_remove(&reactor, settle_timer.fd);
+      close(settle_timer.fd);
+    });
+  } else {
+    sd_notify_status("running");
+  }
+
+  sd_notify("READY=1");
+
+  if (simulate_loop) {
+    sim_plant_t sim;
+    unsigned long ticks = 0;
+    int64_t started = now_real_us();
+
+    sim_plant_open(&sim, sensors, pwm_cap);
+
+    // the control socket and the signals are still served between ticks
+    for (; ticks < oobj.ticks && reactor.running; ticks++) {
+      virtual_clock_us += int64_t(timer.period) * 1000;
+      sim_plant_step(&sim, timer.period / 1000.0);
+      tick();
+      reactor_run_once(&reactor, 0);
     }
 
-    temperature_old = temperature;
+    double elapsed = (now_real_us() - started) / 1e6;
+    sprintf_stderr("%s: %lu ticks, %.3f simulated seconds in %.3f s (%.0f ticks/s)", argv0, ticks,
+                   virtual_clock_us / 1e6, elapsed, elapsed > 0 ? ticks / elapsed : 0.0);
+  } else {
+    reactor_run(&reactor);
+  }
+
+  sd_notify("STOPPING=1");
 
-    std::this_thread::sleep_for(interval);
+  if (oobj.mode == MODE_MPC) {
+    mkdir(STATE_DIR, 0755);
+    mpc_save(&mpc, MODEL_STATE_PATH);
   }
 
+  errno = EXIT_SUCCESS;
+  exit_handler(EXIT_SUCCESS);
+
   return 0;
 }
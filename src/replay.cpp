@@ -0,0 +1,186 @@
+#include <getopt.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <thread>
+
+#include "config.h"
+#include "defines.h"
+#include "interpolate.h"
+#include "load_config.h"
+#include "log.h"
+#include "parse_table.h"
+#include "replay.h"
+#include "simulation.h"
+#include "utils.h"
+
+using std::string;
+using std::vector;
+
+void print_help_exit() {
+  printf(
+      // clang-format off
+      "%s [options] --trace <path> <candidate>...\n"
+      "Run each candidate table on recorded workloads and compare the results.\n"
+      "A candidate is a table file, or a directory holding `table' and optionally `config'.\n"
+      "    -h --help                       Show this help\n"
+      "    -v --version                    Show version\n"
+      "    -t --trace <path>               Workload to replay, a CSV file, a recorded history\n"
+      "                                    file or a copy of the telemetry segment (can be\n"
+      "                                    repeated)\n"
+      "    -c --config <path>              Config of the candidates without their own\n"
+      "                                    (defaults to the installed one)\n"
+      "    -p --plant <path>               Parameters of the simulated board\n"
+      "       --pwm-cap <int>              Highest pwm of the fan (defaults to 255)\n"
+      "       --threshold <int>            Temperature to stay under, in millidegrees\n"
+      "                                    (defaults to characterize_target)\n"
+      "    -j --jobs <int>                 Parallel runs (defaults to the number of cpus)\n"
+      "       --debug                      Increase verbosity in syslog\n",
+      // clang-format on
+      argv0);
+  exit(EXIT_SUCCESS);
+}
+
+static unsigned parse_unsigned(const char* option, const char* value) {
+  try {
+    return std::stoul(value);
+  } catch (...) {
+    sprintf_stderr("%s: cannot parse argument `%s' for %s", argv0, value, option);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static bool is_directory(const string& path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/*
+ * A table file, or a directory with a table and its own config
+ */
+static bool load_candidate(const string& path, const options_t& base, candidate_t* candidate) {
+  string table_path = path;
+  vector<coord_t> table;
+
+  candidate->name = path;
+  candidate->options = base;
+
+  if (is_directory(path)) {
+    string config_path = path + "/config";
+    table_path = path + "/table";
+
+    if (access(config_path.c_str(), R_OK) == 0 &&
+        !load_config(&candidate->options, config_path.c_str())) {
+      return false;
+    }
+  }
+
+  if (!try_parse_table(table_path.c_str(), &table, true) || table.empty()) {
+    sprintf_stderr("%s: no usable table for `%s'", argv0, path.c_str());
+    return false;
+  }
+
+  candidate->curve = compile_curve(table, candidate->options.table_step);
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  enum { OPTION_PWM_CAP = 256, OPTION_THRESHOLD, OPTION_REPLAY_DEBUG };
+
+  vector<string> trace_paths;
+  const char* config_path = CONFIG_FILE_PATH;
+  const char* plant_path = nullptr;
+  unsigned pwm_cap = 255;
+  unsigned threshold = 0;
+  unsigned jobs = std::max(std::thread::hardware_concurrency(), 1u);
+
+  argv0 = PACKAGE_NAME "-replay";
+
+  // clang-format off
+  static const struct option long_options[] = {
+    {"help",            no_argument,        NULL, 'h'},
+    {"version",         no_argument,        NULL, 'v'},
+    {"trace",           required_argument,  NULL, 't'},
+    {"config",          required_argument,  NULL, 'c'},
+    {"plant",           required_argument,  NULL, 'p'},
+    {"pwm-cap",         required_argument,  NULL, OPTION_PWM_CAP},
+    {"threshold",       required_argument,  NULL, OPTION_THRESHOLD},
+    {"jobs",            required_argument,  NULL, 'j'},
+    {"debug",           no_argument,        NULL, OPTION_REPLAY_DEBUG},
+    {NULL,              0,                  NULL, 0}};
+  // clang-format on
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "hvt:c:p:j:", long_options, NULL)) >= 0) {
+    switch (opt) {
+      case 'h':
+        print_help_exit();
+        break;
+      case 'v':
+        std::cout << PACKAGE_STRING << std::endl;
+        exit(EXIT_SUCCESS);
+      case 't':
+        trace_paths.push_back(optarg);
+        break;
+      case 'c':
+        config_path = optarg;
+        break;
+      case 'p':
+        plant_path = optarg;
+        break;
+      case 'j':
+        jobs = std::max(parse_unsigned("--jobs", optarg), 1u);
+        break;
+      case OPTION_PWM_CAP:
+        pwm_cap = std::max(parse_unsigned("--pwm-cap", optarg), 1u);
+        break;
+      case OPTION_THRESHOLD:
+        threshold = parse_unsigned("--threshold", optarg);
+        break;
+      case OPTION_REPLAY_DEBUG:
+        enable_debug = true;
+        break;
+      default:
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  if (trace_paths.empty() || optind >= argc) {
+    sprintf_stderr("%s: needs at least one --trace and one candidate, see --help", argv0);
+    exit(EXIT_FAILURE);
+  }
+
+  options_t base;
+  load_config(&base, config_path);
+  if (threshold == 0) threshold = base.sweep.target;
+
+  plant_t plant;
+  if (plant_path) plant_read(&plant, plant_path);
+
+  vector<candidate_t> candidates(argc - optind);
+  for (int i = optind; i < argc; i++) {
+    if (!load_candidate(argv[i], base, &candidates[i - optind])) exit(EXIT_FAILURE);
+  }
+
+  vector<trace_t> traces(trace_paths.size());
+  for (size_t i = 0; i < trace_paths.size(); i++) {
+    if (!trace_load(trace_paths[i].c_str(), &traces[i])) exit(EXIT_FAILURE);
+    trace_infer_load(&traces[i], plant, pwm_cap);
+  }
+
+  int64_t started = now_real_us();
+  vector<replay_result_t> results = replay_all(candidates, traces, plant, pwm_cap, threshold, jobs);
+  double elapsed = (now_real_us() - started) / 1e6;
+
+  sprintf_stderr("%s: %zu candidates on %zu traces in %.3f s, %u jobs", argv0, candidates.size(),
+                 traces.size(), elapsed, jobs);
+
+  printf("candidate,seconds,seconds_above,peak_mc,fan_energy,writes,throttle_minutes\n");
+  for (size_t i = 0; i < candidates.size(); i++) {
+    const replay_result_t& r = results[i];
+    printf("%s,%.0f,%.0f,%u,%.1f,%lu,%.2f\n", candidates[i].name.c_str(), r.seconds,
+           r.seconds_above, r.peak, r.fan_energy, r.writes, r.throttle_seconds / 60);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+/*
+ * Checks shared by the tests, each one prints a line and main() returns
+ * check_result()
+ */
+
+#include <stdio.h>
+
+#include <string>
+
+static int failures = 0;
+
+static inline void check(bool ok, const std::string& what) {
+  printf("%s %s\n", ok ? "ok  " : "FAIL", what.c_str());
+  if (!ok) failures++;
+}
+
+// with the measured value, for the checks against a bound
+static inline void check(bool ok, const std::string& what, double value) {
+  printf("%s %s (%.2f)\n", ok ? "ok  " : "FAIL", what.c_str(), value);
+  if (!ok) failures++;
+}
+
+static inline int check_result() { return failures == 0 ? 0 : 1; }
@@ -0,0 +1,132 @@
+/*
+ * store_config, clocks_max_freq and restore_config on a fake sysfs tree,
+ * one per soc family
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fstream>
+#include <map>
+#include <string>
+
+#include "check.h"
+#include "jetson_clocks.h"
+
+using std::map;
+using std::string;
+
+static string read_text(const string& path) {
+  string value;
+  read_value(path, &value);
+  return value;
+}
+
+/*
+ * Create every file of `files' under `root', with its parent directories
+ */
+static void build_tree(const string& root, const map<string, string>& files) {
+  for (const auto& file : files) {
+    string path = root + file.first;
+    string command = "mkdir -p '" + path.substr(0, path.rfind('/')) + "'";
+
+    if (system(command.c_str()) != 0) {
+      check(false, "cannot create " + path);
+      continue;
+    }
+
+    std::ofstream(path) << file.second;
+  }
+}
+
+static map<string, string> common_files() {
+  return {
+      {"/sys/devices/system/cpu/cpu0/online", "1\n"},
+      {"/sys/devices/system/cpu/cpu0/cpufreq/scaling_min_freq", "102000\n"},
+      {"/sys/devices/system/cpu/cpu0/cpufreq/scaling_max_freq", "1479000\n"},
+      {"/sys/devices/system/cpu/cpu0/cpuidle/state0/disable", "0\n"},
+      {"/sys/devices/system/cpu/cpu0/cpuidle/state1/disable", "0\n"},
+      {"/sys/devices/system/cpu/cpu1/online", "0\n"},
+      {"/sys/devices/system/cpu/cpu1/cpufreq/scaling_min_freq", "102000\n"},
+      {"/sys/devices/system/cpu/cpu1/cpufreq/scaling_max_freq", "1479000\n"},
+      {"/sys/class/devfreq/17000000.gv11b/min_freq", "114750000\n"},
+      {"/sys/class/devfreq/17000000.gv11b/max_freq", "1377000000\n"},
+      {"/sys/class/devfreq/17000000.gv11b/device/railgate_enable", "1\n"},
+      {"/sys/devices/pwm-fan/target_pwm", "0\n"},
+      {"/sys/devices/pwm-fan/temp_control", "1\n"},
+  };
+}
+
+/*
+ * store, max, then restore puts every file back but the emc rate, which
+ * is not stored (nor by jetson_clocks), releasing the override frees it
+ */
+static void run_family(const string& family, map<string, string> files,
+                       const map<string, string>& expected_max, const string& emc_rate) {
+  char dir[] = "/tmp/clocks_test.XXXXXX";
+  if (!mkdtemp(dir)) {
+    check(false, family + ": temporary directory");
+    return;
+  }
+
+  string root = dir;
+  files["/proc/device-tree/compatible"] = string("nvidia,p3449\0nvidia,", 20) + family + '\0';
+  build_tree(root, files);
+  set_path_root(root);
+
+  string state = root + "/state.conf";
+  store_config(state.c_str());
+  clocks_max_freq();
+
+  for (const auto& expected : expected_max) {
+    check(read_text(root + expected.first) == expected.second,
+          family + ": max sets " + expected.first + " to " + expected.second);
+  }
+
+  restore_config(state.c_str());
+
+  for (const auto& file : files) {
+    if (file.first == "/proc/device-tree/compatible" || file.first == emc_rate) continue;
+
+    string original = file.second;
+    trim(original);
+    check(read_text(root + file.first) == original, family + ": restored " + file.first);
+  }
+
+  set_path_root("");
+  string command = "rm -rf '" + root + "'";
+  if (system(command.c_str()) != 0) check(false, family + ": cleanup");
+}
+
+int main() {
+  map<string, string> t194 = common_files();
+  t194["/sys/kernel/debug/bpmp/debug/clk/emc/max_rate"] = "2133000000\n";
+  t194["/sys/kernel/debug/bpmp/debug/clk/emc/rate"] = "665600000\n";
+  t194["/sys/kernel/debug/bpmp/debug/clk/emc/mrq_rate_locked"] = "0\n";
+  t194["/sys/kernel/nvpmodel_emc_cap/emc_iso_cap"] = "1600000000\n";
+
+  run_family(TEGRA_194, t194,
+             {{"/sys/devices/system/cpu/cpu0/cpufreq/scaling_min_freq", "1479000"},
+              {"/sys/devices/system/cpu/cpu1/online", "1"},
+              {"/sys/devices/system/cpu/cpu0/cpuidle/state0/disable", "0"},
+              {"/sys/devices/system/cpu/cpu0/cpuidle/state1/disable", "1"},
+              {"/sys/class/devfreq/17000000.gv11b/min_freq", "1377000000"},
+              {"/sys/class/devfreq/17000000.gv11b/device/railgate_enable", "0"},
+              // capped by nvpmodel for the isochronous clients
+              {"/sys/kernel/debug/bpmp/debug/clk/emc/rate", "1600000000"},
+              {"/sys/kernel/debug/bpmp/debug/clk/emc/mrq_rate_locked", "1"}},
+             "/sys/kernel/debug/bpmp/debug/clk/emc/rate");
+
+  map<string, string> t210 = common_files();
+  t210["/sys/kernel/debug/tegra_bwmgr/emc_max_rate"] = "1600000000\n";
+  t210["/sys/kernel/debug/clk/override.emc/clk_update_rate"] = "0\n";
+  t210["/sys/kernel/debug/clk/override.emc/clk_state"] = "0\n";
+
+  run_family(TEGRA_210, t210,
+             {{"/sys/devices/system/cpu/cpu0/cpufreq/scaling_min_freq", "1479000"},
+              {"/sys/kernel/debug/clk/override.emc/clk_update_rate", "1600000000"},
+              {"/sys/kernel/debug/clk/override.emc/clk_state", "1"}},
+             "/sys/kernel/debug/clk/override.emc/clk_update_rate");
+
+  return check_result();
+}
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Build a fake tree from the fixtures in this directory, for --root
+#
+#   test/fake-root.sh /tmp/fantable-root
+#   fantable --root /tmp/fantable-root --simulate --ticks 10000
+set -e
+
+here=$(cd "$(dirname "$0")" && pwd)
+root=${1:?usage: $0 <directory>}
+
+mkdir -p "$root/sys/devices/virtual/thermal" "$root/sys/devices/pwm-fan" \
+  "$root/etc/fantable" "$root/var/run" "$root/var/lib/fantable" "$root/dev/shm"
+
+for zone in "$here"/thermal_zone*; do
+  cp -r "$zone" "$root/sys/devices/virtual/thermal/"
+done
+
+# the pmic reports a fixed 100 C, leave it out like on a real board
+printf 'ignore_sensors = PMIC\n' > "$root/etc/fantable/config"
+cp "$here/table" "$root/etc/fantable/table"
+
+fan="$root/sys/devices/pwm-fan"
+cp "$here/pwm_cap" "$fan/pwm_cap"
+for file in target_pwm cur_pwm temp_control tach_enable rpm_measured; do
+  echo 0 > "$fan/$file"
+done
+
+# parameters of the simulated board, see plant.h
+cat > "$root/plant" <<EOF
+ambient = 25
+load = 0.5
+EOF
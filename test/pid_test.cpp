@@ -0,0 +1,158 @@
+/*
+ * pid_update() against the simulated board of plant.h
+ *
+ * Full load needs about 46% of fan to hold 60 C, full fan holds 45 C.
+ */
+
+#include <math.h>
+#include <stdio.h>
+
+#include <algorithm>
+
+#include "check.h"
+#include "pid_controller.h"
+#include "plant.h"
+
+#define TICK_MS 2000
+// the integral stops just short of 100%, close enough to full speed
+#define SATURATED 99.0
+
+typedef struct {
+  double min_temp = 1000;
+  double max_temp = 0;
+  double last_temp = 0;
+  double min_output = 1000;
+  double max_output = 0;
+} run_t;
+
+/*
+ * `seconds' of control, the pwm computed on a tick is applied until the next one
+ */
+static run_t run(pid_controller_t* pid, plant_t* plant, int64_t* time_ms, unsigned seconds) {
+  run_t r;
+
+  for (int64_t end = *time_ms + seconds * 1000; *time_ms < end; *time_ms += TICK_MS) {
+    unsigned speed = pid_update(pid, plant_temp(plant), *time_ms);
+
+    plant->pwm = speed / (100.0 * CURVE_SPEED_SCALE);
+    plant_step(plant, TICK_MS / 1000.0);
+
+    r.min_temp = std::min(r.min_temp, plant->temp);
+    r.max_temp = std::max(r.max_temp, plant->temp);
+    r.min_output = std::min(r.min_output, pid->output);
+    r.max_output = std::max(r.max_output, pid->output);
+  }
+
+  r.last_temp = plant->temp;
+  return r;
+}
+
+/*
+ * A cold board at full load settles on the setpoint. The fan is off until
+ * the setpoint is crossed and the integral starts from 0, with the default
+ * ki the board overshoots by a few degrees meanwhile.
+ */
+static void test_step() {
+  pid_controller_t pid;
+  plant_t plant;
+  int64_t time_ms = 0;
+
+  plant.temp = 40;
+  plant.load = 1;
+
+  run_t rise = run(&pid, &plant, &time_ms, 1800);
+  run_t held = run(&pid, &plant, &time_ms, 600);
+
+  check(rise.max_temp < 68, "step: overshoot under 8 C", rise.max_temp);
+  check(fabs(held.min_temp - 60) < 0.5 && fabs(held.max_temp - 60) < 0.5,
+        "step: held within 0.5 C", held.max_temp - held.min_temp);
+}
+
+// the load halves and comes back, the integral finds the new speed each time
+static void test_disturbance() {
+  pid_controller_t pid;
+  plant_t plant;
+  int64_t time_ms = 0;
+
+  plant.temp = 60;
+  plant.load = 1;
+  run(&pid, &plant, &time_ms, 1800);
+
+  plant.load = 0.5;
+  run_t drop = run(&pid, &plant, &time_ms, 1800);
+  check(drop.min_temp > 55, "disturbance: load drop undershoot under 5 C", drop.min_temp);
+  check(fabs(drop.last_temp - 60) < 0.5, "disturbance: back on the setpoint after a drop",
+        drop.last_temp);
+
+  plant.load = 1;
+  run_t rise = run(&pid, &plant, &time_ms, 1800);
+  check(rise.max_temp < 65, "disturbance: load rise overshoot under 5 C", rise.max_temp);
+  check(fabs(rise.last_temp - 60) < 0.5, "disturbance: back on the setpoint after a rise",
+        rise.last_temp);
+}
+
+// a long saturation does not wind the integral up past what the output can use
+static void test_anti_windup() {
+  pid_controller_t pid;
+  plant_t plant;
+  int64_t time_ms = 0;
+
+  // full fan holds 45 C, the setpoint cannot be reached
+  pid.setpoint = 40000;
+  plant.temp = 50;
+  plant.load = 1;
+
+  run(&pid, &plant, &time_ms, 600);
+  run_t stuck = run(&pid, &plant, &time_ms, 3600);
+  check(stuck.min_output >= SATURATED, "anti-windup: saturated while out of reach", stuck.min_output);
+  // integrating stops once the output saturates, not once the integral does
+  check(pid.integral < 100 - pid.kp * 4, "anti-windup: integral stops at saturation",
+        pid.integral);
+
+  /*
+   * now full fan holds 32 C. The integral unwinds at ki per degree second
+   * once 40 C is crossed, that costs a few degrees of undershoot.
+   */
+  plant.load = 0.2;
+  run_t after = run(&pid, &plant, &time_ms, 1800);
+
+  check(after.min_temp > 35, "anti-windup: undershoot under 5 C", after.min_temp);
+  check(fabs(after.last_temp - 40) < 0.5, "anti-windup: back on the setpoint", after.last_temp);
+}
+
+// moving the setpoint changes the output by kp times the step, the derivative does not kick
+static void test_derivative_on_measurement() {
+  pid_controller_t pid;
+  int64_t time_ms = 0;
+
+  pid.ki = 0;
+  for (int i = 0; i < 10; i++, time_ms += TICK_MS) pid_update(&pid, 62000, time_ms);
+
+  double before = pid.output;
+  pid.setpoint = 58000;
+  pid_update(&pid, 62000, time_ms);
+
+  check(fabs(pid.output - before - pid.kp * 2) < 1e-9, "derivative: no kick on a setpoint change",
+        pid.output - before);
+
+  // the same 2 C of error from the measurement goes through the derivative
+  pid_controller_t measured;
+  time_ms = 0;
+  measured.ki = 0;
+  for (int i = 0; i < 10; i++, time_ms += TICK_MS) pid_update(&measured, 62000, time_ms);
+
+  before = measured.output;
+  pid_update(&measured, 64000, time_ms);
+
+  check(measured.output - before > measured.kp * 2 + 1, "derivative: reacts to the measurement",
+        measured.output - before);
+}
+
+int main() {
+  test_step();
+  test_disturbance();
+  test_anti_windup();
+  test_derivative_on_measurement();
+
+  return check_result();
+}
@@ -0,0 +1,139 @@
+/*
+ * recorder_append() and record_read_file() through a file in a temporary
+ * root, and the files record_read_file() has to refuse
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "recorder.h"
+
+using std::string;
+using std::vector;
+
+typedef struct {
+  int64_t time;
+  vector<int32_t> values;
+} sample_t;
+
+static vector<sample_t> read_samples(const string& path, bool* valid, vector<string>* names) {
+  vector<sample_t> samples;
+
+  *valid = record_read_file(path.c_str(), [&](const vector<string>& file_names, int64_t time,
+                                              const vector<int32_t>& values) {
+    *names = file_names;
+    samples.push_back({time, values});
+  });
+
+  return samples;
+}
+
+static string read_bytes(const string& path) {
+  std::ifstream in_stream(path, std::ios::binary);
+  return string(std::istreambuf_iterator<char>(in_stream), std::istreambuf_iterator<char>());
+}
+
+static void write_bytes(const string& path, const string& bytes) {
+  std::ofstream(path, std::ios::binary) << bytes;
+}
+
+/*
+ * Small steps go into deltas, a jump past int16 and a gap past uint16
+ * milliseconds each start a new block
+ */
+static void test_round_trip(const string& root) {
+  vector<string> names = {"CPU-therm", "GPU-therm"};
+  vector<sample_t> written;
+  int64_t time = 1700000000000;
+
+  recorder_t rec;
+  recorder_open(&rec, names);
+
+  for (int i = 0; i < 20; i++) {
+    int32_t cpu = 40000 + i * 100;
+    // a fan coming back from a stall, far past an int16 delta
+    if (i >= 10) cpu += 40000;
+    // the daemon was stopped for a while, past an uint16 dt
+    time += i == 15 ? 70000 : 1000;
+
+    written.push_back({time, {cpu, 38000 - i * 50, cpu, 128 + i, 128 + i, i >= 12 ? 3000 : -1}});
+    recorder_append(&rec, time, written.back().values);
+  }
+
+  recorder_close(&rec);
+
+  vector<string> files = record_files();
+  check(files.size() == 1, "round trip: one file");
+  check(rec.writes == 3, "round trip: a block per overflow", rec.writes);
+  if (files.empty()) return;
+
+  bool valid;
+  vector<string> read_names;
+  vector<sample_t> read = read_samples(files[0], &valid, &read_names);
+
+  check(valid, "round trip: a record file");
+  check(read_names == names, "round trip: zone names");
+  check(read.size() == written.size(), "round trip: every record", read.size());
+
+  bool same = read.size() == written.size();
+  for (size_t i = 0; same && i < read.size(); i++) {
+    same = read[i].time == written[i].time && read[i].values == written[i].values;
+  }
+  check(same, "round trip: times and values");
+
+  string bytes = read_bytes(files[0]);
+  string path = root + "/broken.bin";
+  record_header_t header;
+  memcpy(&header, bytes.data(), sizeof(header));
+
+  // a block cut short by a crash ends the file
+  write_bytes(path, bytes.substr(0, bytes.size() - 3));
+  read = read_samples(path, &valid, &read_names);
+  check(valid && read.size() == written.size() - 1, "truncated: the records before the cut");
+
+  write_bytes(path, bytes.substr(0, sizeof(header) + RECORD_NAME_SIZE / 2));
+  read_samples(path, &valid, &read_names);
+  check(!valid, "truncated: in the zone names");
+
+  record_header_t corrupt = header;
+  corrupt.zone_count = 0x40000000;
+  corrupt.header_size = sizeof(header) + corrupt.zone_count * RECORD_NAME_SIZE;
+  write_bytes(path, string((char*)&corrupt, sizeof(corrupt)) + bytes.substr(sizeof(header)));
+  read_samples(path, &valid, &read_names);
+  check(!valid, "corrupt: too many zones");
+
+  corrupt = header;
+  corrupt.header_size += 1;
+  write_bytes(path, string((char*)&corrupt, sizeof(corrupt)) + bytes.substr(sizeof(header)));
+  read_samples(path, &valid, &read_names);
+  check(!valid, "corrupt: header size does not match the zones");
+
+  unlink(path.c_str());
+  unlink(files[0].c_str());
+}
+
+int main() {
+  char dir[] = "/tmp/recorder_test.XXXXXX";
+  if (!mkdtemp(dir)) {
+    check(false, "temporary directory");
+    return check_result();
+  }
+
+  string root = dir;
+  string command = "mkdir -p '" + root + "/var/lib'";
+  if (system(command.c_str()) != 0) check(false, "state directory");
+
+  set_path_root(root);
+  test_round_trip(root);
+
+  set_path_root("");
+  command = "rm -rf '" + root + "'";
+  if (system(command.c_str()) != 0) check(false, "cleanup");
+
+  return check_result();
+}
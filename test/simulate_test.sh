@@ -0,0 +1,75 @@
+#!/bin/sh
+# The daemon and the characterization on the simulated board of a fake tree
+#
+#   test/simulate_test.sh [path to fantable]
+
+srcdir=${srcdir:-$(dirname "$0")/..}
+fantable=${1:-./fantable}
+root=$(mktemp -d /tmp/simulate_test.XXXXXX)
+trap 'rm -rf "$root"' EXIT
+
+failures=0
+
+check() {
+  if [ "$1" = 0 ]; then
+    echo "ok   $2"
+  else
+    echo "FAIL $2"
+    failures=$((failures + 1))
+  fi
+}
+
+sh "$srcdir/test/fake-root.sh" "$root" || exit 1
+
+zones="$root/sys/devices/virtual/thermal"
+fan="$root/sys/devices/pwm-fan"
+
+# 5000 ticks of 2 s, the board has long settled
+"$fantable" --root "$root" --simulate --ticks 5000
+check $? "daemon: exits cleanly"
+
+cpu=$(cat "$zones/thermal_zone0/temp")
+aoc=$(cat "$zones/thermal_zone3/temp")
+pwm=$(cat "$fan/cur_pwm")
+
+# the hottest zone drives the table, half load settles around 51 C
+[ "$aoc" -gt 45000 ] && [ "$aoc" -lt 60000 ] && [ "$cpu" -lt "$aoc" ]
+check $? "daemon: settled at $cpu and $aoc mC"
+
+# the pwm written for that temperature, interpolated from the table
+expected=$(awk -v temp="$aoc" -v cap="$(cat "$fan/pwm_cap")" '
+  { x[NR] = $1 * 1000; y[NR] = $2 }
+  END {
+    speed = y[NR]
+    if (temp <= x[1]) speed = y[1]
+    for (i = 1; i < NR; i++) {
+      if (temp >= x[i] && temp <= x[i + 1]) {
+        speed = y[i] + (y[i + 1] - y[i]) * (temp - x[i]) / (x[i + 1] - x[i])
+        break
+      }
+    }
+    printf "%d\n", speed * cap / 100
+  }' "$root/etc/fantable/table")
+
+[ "$pwm" -ge $((expected - 2)) ] && [ "$pwm" -le $((expected + 2)) ]
+check $? "daemon: pwm $pwm follows the table ($expected)"
+
+[ "$(cat "$zones/thermal_zone1/temp")" = 100000 ]
+check $? "daemon: ignored zones are left alone"
+
+[ "$(cat "$fan/target_pwm")" = 0 ]
+check $? "daemon: the fan is handed back on exit"
+
+# the sweep stops at the limit, before the fan is turned off
+"$fantable" --root "$root" --characterize --simulate --csv "$root/sweep.csv" > "$root/table.out"
+check $? "characterize: exits cleanly"
+
+rows=$(tail -n +2 "$root/sweep.csv" | wc -l)
+last=$(tail -n 1 "$root/sweep.csv" | cut -d, -f1)
+[ "$rows" -ge 3 ] && [ "$last" -gt 0 ]
+check $? "characterize: $rows steps, stopped at pwm $last"
+
+grep -q '^65 [1-9][0-9]*$' "$root/table.out"
+check $? "characterize: a speed for the target temperature"
+
+exit $((failures > 0))
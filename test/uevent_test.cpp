@@ -0,0 +1,134 @@
+/*
+ * uevent.h with a socketpair standing in for the netlink socket and a
+ * thermal zone in a temporary directory
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <string>
+
+#include "check.h"
+#include "uevent.h"
+
+using std::string;
+
+static void write_text(const string& path, const string& text) {
+  std::ofstream out_stream(path);
+  out_stream << text;
+}
+
+static int read_int(const string& path) {
+  std::ifstream in_stream(path);
+  int value = -1;
+  in_stream >> value;
+  return value;
+}
+
+// NUL separated, like the kernel sends them
+static void send_uevent(int fd, const string& fields) {
+  string message = fields;
+  for (auto& c : message) {
+    if (c == '\n') c = '\0';
+  }
+  send(fd, message.data(), message.size(), 0);
+}
+
+static void test_uevents() {
+  int pair[2];
+  socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0, pair);
+
+  check(!uevent_drain(pair[0]), "drain: nothing pending");
+
+  send_uevent(pair[1], "change@/devices/virtual/net/eth0\nACTION=change\nSUBSYSTEM=net\n");
+  check(!uevent_drain(pair[0]), "drain: other subsystems are ignored");
+
+  send_uevent(pair[1], "change@/devices/virtual/net/eth0\nACTION=change\nSUBSYSTEM=net\n");
+  send_uevent(pair[1], "change@/devices/virtual/thermal/thermal_zone0\nACTION=change\n"
+                       "SUBSYSTEM=thermal\nTRIP=1\n");
+  check(uevent_drain(pair[0]), "drain: a thermal event among others");
+  check(!uevent_drain(pair[0]), "drain: every message consumed");
+
+  send_uevent(pair[1], "change@/x\nSUBSYSTEM=thermalx\n");
+  check(!uevent_drain(pair[0]), "drain: only the exact subsystem");
+
+  close(pair[0]);
+  close(pair[1]);
+}
+
+static void test_trip_points() {
+  char dir[] = "/tmp/uevent_test.XXXXXX";
+  if (!mkdtemp(dir)) {
+    check(false, "trips: temporary directory");
+    return;
+  }
+
+  string zone = dir;
+
+  // glob order differs from the order of the values
+  write_text(zone + "/trip_point_0_type", "active\n");
+  write_text(zone + "/trip_point_0_temp", "70000\n");
+  write_text(zone + "/trip_point_1_type", "active\n");
+  write_text(zone + "/trip_point_1_temp", "50000\n");
+  write_text(zone + "/trip_point_2_type", "passive\n");
+  write_text(zone + "/trip_point_2_temp", "90000\n");
+  write_text(zone + "/temp", "60000\n");
+
+  vector<sensor_t> sensors(1);
+  sensors[0].path = zone + "/temp";
+  sensors[0].value = 60000;
+
+  check(setup_trip_points(sensors), "trips: zone found");
+  check(zone_trips[0].has_low && zone_trips[0].low.path == zone + "/trip_point_1_temp" &&
+            zone_trips[0].high.path == zone + "/trip_point_0_temp",
+        "trips: picked by value, lowest is low");
+
+  program_trip_points(sensors, 2000);
+  check(read_int(zone + "/trip_point_1_temp") == 58000 &&
+            read_int(zone + "/trip_point_0_temp") == 62000,
+        "trips: band around the temperature");
+  check(read_int(zone + "/trip_point_2_temp") == 90000, "trips: passive trip untouched");
+
+  // inside the band nothing is written
+  write_text(zone + "/trip_point_0_temp", "1\n");
+  sensors[0].value = 61500;
+  program_trip_points(sensors, 2000);
+  check(read_int(zone + "/trip_point_0_temp") == 1, "trips: no write inside the band");
+
+  sensors[0].value = 62000;
+  program_trip_points(sensors, 2000);
+  check(read_int(zone + "/trip_point_1_temp") == 60000 &&
+            read_int(zone + "/trip_point_0_temp") == 64000,
+        "trips: moved once the band is left");
+
+  program_trip_points(sensors, 3000);
+  check(read_int(zone + "/trip_point_0_temp") == 65000, "trips: moved when the window changes");
+
+  // the band is now above both original values, low has to go down first
+  sensors[0].value = 90000;
+  program_trip_points(sensors, 3000);
+  check(read_int(zone + "/trip_point_1_temp") == 87000 &&
+            read_int(zone + "/trip_point_0_temp") == 93000,
+        "trips: band above the original values");
+
+  restore_trip_points();
+  check(read_int(zone + "/trip_point_1_temp") == 50000 &&
+            read_int(zone + "/trip_point_0_temp") == 70000,
+        "trips: restored from above");
+
+  for (const char* name : {"trip_point_0_type", "trip_point_0_temp", "trip_point_1_type",
+                           "trip_point_1_temp", "trip_point_2_type", "trip_point_2_temp", "temp"}) {
+    unlink((zone + "/" + name).c_str());
+  }
+  rmdir(dir);
+}
+
+int main() {
+  test_uevents();
+  test_trip_points();
+
+  return check_result();
+}